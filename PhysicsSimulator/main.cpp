@@ -11,9 +11,33 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <vector>
 #include <math.h>
 #include <numeric>
+#include <algorithm>
+#include <thread>
+#include <map>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 //macOS: accepted subscribers get SO_NOSIGPIPE instead
+#endif
+#include <locale.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
 
 #include "shaderClass.h"
 #include "VAO.h"
@@ -30,6 +54,9 @@ struct PointMass{
     vector<float> forces; // {f_x, f_y, f_z}
     vector<float> potential;
     vector<float> kinetic;
+    int last_obstacle = -1; // obstacle and triangle this mass touched last step, tested first
+    int last_triangle = -1;
+    int cluster = -1; // rigid cluster this mass is part of, -1 if it moves on its own
 };
 
 struct Spring{
@@ -40,25 +67,568 @@ struct Spring{
     int m1; // connected to which PointMass
     vector<float> potential;
     float original_L0;
+    bool rigid = false; // both ends are in the same rigid cluster, so the spring is not evaluated
+    float max_strain = 0.5f; // strain |L-L0|/L0 at which the spring breaks when fracture is on
+    float amplitude = 0.25f; // change of rest length when the spring is in breathing_springs
+    float phase = 0.0f; // phase of that change
+};
+
+struct Body{
+    int first_mass; // index of the first PointMass of this body
+    int num_masses;
+    int first_spring; // index of the first Spring of this body
+    int num_springs;
+    bool asleep; // sleeping bodies are skipped by the step kernels
+    int still_steps; // consecutive steps spent below the sleep thresholds
+    float box_min[3]; // bounding box when the body fell asleep, used to wake it on contact
+    float box_max[3];
+};
+
+struct RigidCluster{
+    vector<int> members; // masses that move together as one rigid body
+    vector<glm::vec3> offsets; // position of every member relative to the center of mass, in the cluster frame
+    int body; // body the cluster belongs to
+    float mass;
+    glm::mat3 inertia_inv; // inverse inertia tensor in the cluster frame
+    glm::vec3 position; // center of mass
+    glm::vec3 velocity;
+    glm::quat orientation;
+    glm::vec3 angular_momentum;
+};
+
+struct ModalModel{
+    int num_dofs; // 3 per mass
+    int num_modes; // K, including the rigid modes
+    int num_rigid; // modes with zero frequency (translation and linearized rotation)
+    vector<float> rest; // rest positions {x0, y0, z0, x1, ...}
+    vector<float> modes; // mass-orthonormal modes, num_dofs values per mode
+    vector<float> frequencies_2; // squared angular frequency of every mode
+    vector<float> derivatives; // modal derivatives of the elastic mode pairs i <= j, num_dofs values per pair
+    vector<float> gravity; // gravity projected onto the modes
+    vector<float> actuation; // force on every mode per unit change of rest length, num_modes values per breathing spring
+    vector<int> cubature; // masses used to resolve contact
+    vector<float> cubature_weights; // number of masses every cubature mass stands for
+    vector<float> cubature_masses; // mass every cubature mass stands for
+    vector<float> q; // modal coordinates
+    vector<float> q_dot;
+    vector<float> force; // scratch for update_modal, num_modes values
+};
+
+struct SparseMatrix{
+    int rows;
+    int cols;
+    vector<int> row_start; // compressed sparse rows, rows+1 entries
+    vector<int> column;
+    vector<float> value;
+};
+
+struct Multigrid{
+    bool lattice; // the masses sit on a regular grid, otherwise the solve falls back to Jacobi-preconditioned CG
+    vector<SparseMatrix> A; // M + dt^2 K on every level, A[0] is the full system
+    vector<SparseMatrix> P; // prolongation from level l+1 to level l (trilinear)
+    vector<SparseMatrix> R; // restriction, the transpose of P
+    vector<vector<float>> diagonal_inv; // inverse diagonal of A on every level, for the Jacobi smoother
+    vector<SparseMatrix> AP; // A[l]*P[l], kept so the Galerkin products reuse their sparsity
+    vector<vector<float>> x, b, r; // scratch per level
+    vector<float> rhs, v, p, Ap; // scratch for update_implicit and multigrid_solve, A[0].rows values each
+    vector<int> spring_blocks; // offsets of the (m0,m0), (m0,m1), (m1,m0), (m1,m1) 3x3 blocks of every spring in A[0]
+    vector<int> diagonal_blocks; // offset of the diagonal 3x3 block of every mass in A[0]
+};
+
+struct Material{
+    float k; // spring constant
+    float max_strain; // breaking strain of its springs
+    float amplitude; // actuation amplitude, springs of a material with 0 are not actuated
+    float phase; // actuation phase
+};
+
+struct Genome{
+    int nx, ny, nz; // cubes along every axis
+    vector<char> voxels; // material of every cube, x fastest: voxels[(k*ny + j)*nx + i], 0 is empty, m is materials[m-1]
+};
+
+struct Tetrahedron{
+    int m[4]; // corner masses, positively oriented at rest
+    int body;
+    float Dm_inv[9]; // inverse of the rest edge matrix [x1-x0, x2-x0, x3-x0], row-major
+    float volume; // rest volume
+    float mu; // Lame parameters of the material
+    float lambda;
+    float energy; // elastic energy at the last force evaluation
+};
+
+struct Handle{
+    int id; // stable identifier of a mass or spring
+    int generation; // bumped every time the id is freed, so handles to a removed element go stale
+};
+
+struct Pool{
+    vector<int> slot; // current index of every id in masses or springs, -1 if the id is free
+    vector<int> generation;
+    vector<int> id_of_slot; // reverse map, -1 for slots that are not in use
+    vector<int> free_ids;
+};
+
+struct Triangle{
+    float v0[3]; // corners, counter-clockwise when seen from the outside
+    float v1[3];
+    float v2[3];
+    float normal[3]; // outward unit normal
+};
+
+struct BVHNode{
+    float box_min[3];
+    float box_max[3];
+    int first; // first triangle of a leaf, or the right child of an inner node (left child is the next node)
+    int count; // number of triangles in a leaf, 0 for inner nodes
+};
+
+struct Obstacle{
+    vector<Triangle> triangles; // ordered so that every leaf covers a contiguous run
+    vector<BVHNode> nodes; // flattened depth-first, nodes[0] is the root
+};
+
+//Binary body file: this header, then every section at a multiple of 64 bytes, all values little-endian
+//  0 mass           double[num_masses]
+//  1 position       float[3*num_masses]
+//  2 velocity       float[3*num_masses]
+//  3 spring ends    int32[2*num_springs], m0 and m1 of every spring
+//  4 rest length    float[num_springs]
+//  5 material       int32[num_springs], index into the materials section
+//  6 materials      float[4*num_materials], k, max_strain, amplitude and phase of every Material
+//  7 actuator group int32[num_actuated], the springs in breathing_springs
+struct BodyFileHeader{
+    char magic[8]; // "PSBODY" padded with zeros
+    uint32_t version;
+    uint32_t num_masses;
+    uint32_t num_springs;
+    uint32_t num_materials;
+    uint32_t num_actuated;
+    uint32_t reserved;
+    uint64_t offset[8]; // byte offset of every section from the start of the file
+};
+
+//Checkpoint: this header, then the records of pack_state, native byte order, meant to be restored on the same build
+struct CheckpointHeader{
+    char magic[8]; // "PSSTATE" padded with zeros
+    uint32_t version;
+    uint32_t num_masses;
+    uint32_t num_springs;
+    uint32_t num_bodies;
+    uint32_t num_actuated;
+    uint32_t num_modes;
+    int32_t iterations;
+    float T;
+    float dt;
+    int32_t calm_checks; // settle phase of main: SettleDetector and the damping it switches
+    uint8_t settled;
+    uint8_t damped;
+    uint8_t padding[2];
+};
+
+struct SettleDetector{
+    int calm_checks = 0; // consecutive checks below the settle thresholds
+    bool settled = false; // stays true once reached
+};
+
+//Actuation run by one fork of a captured state, one value per spring in breathing_springs
+struct Controller{
+    vector<float> amplitude;
+    vector<float> phase;
+};
+
+//Lock-free ring between one producer and one consumer thread. The slots are allocated up front and filled in place:
+//the producer claims a slot, fills it and publishes it, the consumer takes the front slot and releases it when done
+template <typename T>
+struct Ring{
+    vector<T> slots; // sized before the threads start, never resized while in use
+    atomic<size_t> head{0}; // slots published so far
+    atomic<size_t> tail{0}; // slots released so far
+};
+
+//Trajectory file: this header, the frames, then the frame index. Every frame starts at a multiple of 64 bytes with
+//T (float, padded to 64 bytes) followed by its columns, each 64-byte aligned: positions float[3*num_masses],
+//then velocities float[3*num_masses] and spring lengths float[num_springs] if recorded. Native byte order.
+//With quantized positions the positions column is an encode_positions payload whose size is stored after T
+struct TrajectoryHeader{
+    char magic[8]; // "PSTRAJ" padded with zeros
+    uint32_t version;
+    uint32_t num_masses;
+    uint32_t num_springs;
+    uint32_t columns; // bit 0 velocities, bit 1 spring lengths, bit 2 quantized positions, positions are always there
+    uint32_t stride; // steps between frames
+    uint32_t keyframe_interval; // frames between quantized keyframes
+    uint64_t frame_size; // bytes of a full frame, 0 if frames differ in size
+    uint64_t num_frames; // written when the file is closed
+    uint64_t index_offset; // byte offset of the TrajectoryIndexEntry array, written when the file is closed
+    double quantum; // grid spacing of quantized positions, twice the tolerance
+};
+
+//State shared by the position encoder and decoder, which must see the same frames in the same order. Positions are
+//snapped to a grid of spacing quantum. A keyframe stores them relative to the corner of its bounding box, the frames
+//after it store the difference to a linear prediction from the last two frames, so smooth motion codes to a few bits
+struct TrajectoryCodec{
+    double quantum = 0;
+    int keyframe_interval = 1;
+    int frames = 0; // frames coded so far
+    vector<int64_t> current; // grid positions of the frame being coded, axis by axis
+    vector<int64_t> previous;
+    vector<int64_t> before_previous;
+    vector<uint64_t> residuals;
+};
+
+struct TrajectoryIndexEntry{
+    float T;
+    uint32_t size; // bytes of the frame
+    uint64_t offset; // byte offset of the frame
+};
+
+struct TrajectoryRecorder{
+    FILE* file = nullptr;
+    TrajectoryHeader header;
+    Ring<vector<char>> ring; // frames waiting for the writer thread
+    TrajectoryCodec codec; // writer thread
+    vector<char> encoded; // writer thread
+    thread writer;
+    atomic<bool> closing{false};
+    vector<TrajectoryIndexEntry> index; // only touched by the writer thread
+    uint64_t offset = 0; // end of the file so far, writer thread
+    int step = 0;
+    vector<Handle> masses; // what every column records, so compaction and swap-removal do not change its meaning
+    vector<Handle> springs;
+};
+
+struct MappedTrajectory{
+    void* data = nullptr;
+    size_t size = 0;
+    TrajectoryHeader* header = nullptr;
+    TrajectoryIndexEntry* index = nullptr;
+};
+
+//Snapshot of the live masses and springs for one exported file, renumbered so the masses are contiguous
+struct ExportFrame{
+    float T;
+    int number; // file number in the sequence
+    int num_points;
+    int num_lines;
+    vector<float> points; // {x, y, z} per mass
+    vector<float> velocities; // {v_x, v_y, v_z} per mass
+    vector<int> lines; // {m0, m1} per spring, indices into points
+    vector<float> strain; // (L-L0)/L0 per spring
+};
+
+struct SequenceExporter{
+    const char* prefix = nullptr; // files are named <prefix>_<number>.vtk
+    Ring<ExportFrame> ring; // frames waiting for the writer thread
+    vector<char> staging; // big-endian copy of a frame, writer thread
+    thread writer;
+    atomic<bool> closing{false};
+    int step = 0;
+    int frames = 0; // frames handed to the writer
+    int dropped = 0; // frames skipped because the writer was behind
+};
+
+//One row of the energy telemetry
+struct TelemetrySample{
+    int iteration;
+    float T;
+    float potential;
+    float kinetic;
+    float total;
+    float max_speed; // fastest mass
+};
+
+struct Telemetry{
+    FILE* file = nullptr;
+    Ring<TelemetrySample> ring; // samples waiting for the writer thread
+    thread writer;
+    atomic<bool> closing{false};
+    int samples = 0; // samples handed to the writer
+    int dropped = 0; // samples skipped because the ring was full
+};
+
+//Live state in POSIX shared memory: this header, then two buffers of buffer_size bytes. The simulator fills the buffer
+//that is not current and then makes it current, readers use current and check its sequence did not move meanwhile
+struct SharedStateHeader{
+    atomic<uint64_t> magic; // shared_state_magic, stored last, 0 while the segment is being set up
+    uint32_t capacity; // masses a buffer has room for
+    atomic<uint32_t> current; // buffer last published
+    uint64_t buffer_offset[2]; // byte offsets of the buffers from the start of the segment
+    uint64_t buffer_size;
+    char padding[24];
+};
+
+//One buffer of the live state, followed 64-byte aligned by positions float[3*num_masses] of the masses of every body
+struct SharedStateBuffer{
+    atomic<uint64_t> sequence; // odd while the buffer is being written
+    int32_t iteration;
+    uint32_t num_masses;
+    float T;
+    float potential;
+    float kinetic;
+    float total;
+    float max_speed;
+    char padding[28];
+};
+
+struct SharedState{
+    const char* name = nullptr; // shm_open name, e.g. "/physics_simulator"
+    bool owner = false; // created by this process, which unlinks it when closing
+    void* data = nullptr;
+    size_t size = 0;
+    SharedStateHeader* header = nullptr;
 };
 
-const double g = -9.81; //acceleration due to gravity
-const double b = 0.999; //damping (optional) Note: no damping means your cube will bounce forever
-const float spring_constant = 10000.0f; //this worked best for me given my dt and mass of each PointMass
+//Binary frame of the telemetry stream, sent as is in native byte order
+struct StreamFrame{
+    uint32_t size; // sizeof(StreamFrame), fields are only ever added at the end
+    uint32_t version;
+    int32_t iteration;
+    float T;
+    float potential;
+    float kinetic;
+    float total;
+    float center[3]; // centre of mass of every body
+    int32_t contacts; // contact_count of the last step
+    float step_time; // wall-clock ms the last step took
+};
+
+struct StreamSubscriber{
+    int fd; // -1 once the subscriber has gone away
+    StreamFrame pending; // frame being sent, newer frames are dropped until it is out
+    size_t sent; // bytes of pending already sent, sizeof(StreamFrame) when idle
+    int dropped;
+};
+
+struct StreamServer{
+    const char* path = nullptr; // socket file
+    int listen_fd = -1;
+    Ring<StreamFrame> ring; // frames waiting for the server thread
+    thread worker;
+    atomic<bool> closing{false};
+    vector<StreamSubscriber> subscribers; // server thread
+    int dropped = 0; // frames skipped because the ring was full
+};
+
+//Cursor of the scene tokenizer, tokens are runs of non-blank characters and are never copied
+struct SceneTokenizer{
+    const char* at;
+    const char* end;
+    int line;
+};
+
+struct MappedBody{
+    void* data = nullptr; // the whole file, mapped read-only and shared between processes
+    size_t size = 0;
+    BodyFileHeader* header = nullptr;
+    double* mass = nullptr; // views of the sections, straight into the mapping
+    float* position = nullptr;
+    float* velocity = nullptr;
+    int32_t* ends = nullptr;
+    float* rest_length = nullptr;
+    int32_t* material = nullptr;
+    float* materials = nullptr;
+    int32_t* actuated = nullptr;
+};
+
+double g = -9.81; //acceleration due to gravity
+double b = 0.999; //damping (optional) Note: no damping means your cube will bounce forever
+float spring_constant = 10000.0f; //this worked best for me given my dt and mass of each PointMass
+float ground_stiffness = 1000000.0f; //stiffness of the ground at z = 0
+float contact_damping = 0.0f; //damping of the ground and obstacle contact as a fraction of critical, 0 makes bounces lossless
+float spring_damping = 0.0f; //damping of every spring as a fraction of critical, 0 lets the body vibrate forever
+int contact_count = 0; //awake masses touching the ground or an obstacle in the last update_forces
+bool damped = false; //apply the damping b to every velocity each step, settle_phase turns it on until the bodies are at rest
 float T = 0.0;
 float dt = 0.001;
 bool breathing = false;
+vector<int> breathing_springs = {24, 25, 26, 27}; //springs whose rest length update_breathing changes, -1 for one that was removed so the
+                                                 //modal actuation rows and controller values stay lined up
+bool sleeping = false; //deactivate bodies that have come to rest, actuated bodies never do since every breath wakes them
+const float sleep_contact_damping = 0.2f; //contact_damping while sleeping is on, without it the body never comes to rest
+const float sleep_spring_damping = 0.02f; //spring_damping while sleeping is on
+const float modal_contact_damping = 0.2f; //contact_damping in modal mode, contact on a few cubature masses chatters forever without it
+const float contact_chatter = 0.06f; //speed the ground contact keeps resting masses jittering at, measured on the resting cube
+const float sleep_velocity = 2*contact_chatter; //maximum speed of any mass below which the body counts as resting
+const float sleep_rms_velocity = contact_chatter; //mass-weighted RMS speed below which the body counts as resting
+const int sleep_steps = 500; //number of resting steps before the body is put to sleep
+const float settle_energy = 0.05f; //total kinetic energy below which the system counts as settled, above the ground contact chatter
+const float settle_velocity = 5*contact_chatter; //maximum speed of any mass below which the system counts as settled
+const int settle_checks = 50; //consecutive checks, 10 steps apart, that have to pass before actuation starts, longer than a small bounce
+const float sleep_margin = 0.05f; //how close an awake body has to get to wake a sleeping one
+float obstacle_stiffness = ground_stiffness; //same stiffness as the ground, the scene sets both
+const float obstacle_thickness = 0.05f; //how far behind a triangle a mass still gets pushed out
+const int bvh_leaf_size = 4; //maximum number of triangles in a BVH leaf
+const int bvh_bins = 16; //number of bins used to evaluate the SAH split
+bool modal = false; //advance only the lowest vibration modes instead of every mass
+const int modal_modes = 16; //number of modes kept, including the 6 rigid ones
+const int modal_cubature = 32; //number of masses used to resolve contact in modal mode
+bool implicit = false; //backward Euler step solved with multigrid-preconditioned CG, allows much larger dt
+const int cg_iterations = 100; //maximum number of CG iterations per implicit step
+const float cg_tolerance = 1e-5f; //relative residual at which CG stops
+const int multigrid_smoothing = 2; //Jacobi sweeps before and after the coarse grid correction
+const int multigrid_coarsest = 64; //stop coarsening below this many unknowns
+Pool mass_pool; //handles to masses and springs that stay valid while the arrays are compacted
+Pool spring_pool;
+const int pool_reserve = 4096; //extra masses and springs reserved so runtime growth does not reallocate
+const int compact_interval = 1000; //steps between compactions of the gaps left by removed masses and springs
+const float payload_mass = 1.0f; //mass the P key puts on top of the first body, O takes it off again
+const float payload_height = 0.25f; //how far above its supports the payload is put
+const int payload_supports = 4; //highest masses of the body the payload is connected to
+const char* obstacle_file = nullptr; //watertight OBJ mesh added as a static obstacle, e.g. "ramp.obj"
+const char* scene_file = nullptr; //text scene read by load_scene instead of the single cube, e.g. "cube.scene"
+const char* body_file = nullptr; //binary body written by save_body loaded instead of the single cube, e.g. "cube.body"
+const char* save_body_file = nullptr; //the body built at startup (scene, cloud, lattice or cube) is written here for body_file, e.g. "cube.body"
+const char* cloud_file = nullptr; //point cloud, one "x y z" per line, connected by connect_within instead of the single cube, e.g. "bunny.xyz"
+const float cloud_radius = 0.15f; //masses of the cloud closer than this get a spring
+const uint32_t body_version = 1;
+const char* checkpoint_file = nullptr; //state saved here on exit and restored on start if it exists, e.g. "run.checkpoint"
+const uint32_t checkpoint_version = 3;
+const char* trajectory_file = nullptr; //trajectory recorded by record_frame while the window is open, e.g. "run.trajectory"
+const int trajectory_stride = 10; //steps between recorded frames
+const bool record_velocities = false;
+const bool record_lengths = false;
+const float trajectory_tolerance = 0; //largest position error of recorded frames, 0 records exact floats, e.g. 1e-4 for a 0.1mm bound
+const int trajectory_keyframe_interval = 64; //frames between keyframes of quantized trajectories, random access decodes at most this many
+const int trajectory_frames_in_flight = 64; //frames the simulation can be ahead of the writer thread
+const uint32_t trajectory_version = 2;
+const char* export_prefix = nullptr; //VTK sequence written by export_frame while the window is open, e.g. "frames/cube"
+const int export_stride = 100; //steps between exported files
+const int export_frames_in_flight = 8; //snapshots waiting for the writer, later ones are dropped instead of stalling the simulation
+const char* telemetry_file = "energy.csv"; //energy samples streamed while the window is open, nullptr turns them off
+const int telemetry_capacity = 4096; //samples waiting for the writer, later ones are dropped
+const int telemetry_flush_interval = 1000; //ms between flushes, so a crash loses at most this much
+const char* shared_state_name = nullptr; //shared memory the live state is published to with every energy sample, e.g. "/physics_simulator"
+const uint32_t shared_state_version = 2;
+const uint64_t shared_state_magic = 0x50534C4956450000ull | shared_state_version; //"PSLIVE" then the version
+const char* stream_socket = nullptr; //UNIX socket that streams a StreamFrame with every energy sample, e.g. "/tmp/physics_simulator.sock"
+const int stream_capacity = 256; //frames waiting for the server thread, later ones are dropped
+const int stream_buffer_frames = 16; //frames the kernel holds for a subscriber, so a slow one sees recent frames rather than a backlog
+const uint32_t stream_version = 1;
+int writer_threads = 0; //trajectory, export, telemetry and stream threads running, evaluate_forks refuses to fork while any is
+int fork_controllers = 0; //with breathing, settle at startup and try this many actuation phase patterns in forked children, keeping the farthest walker
+const int fork_steps = 5000; //steps every forked controller runs
+const int fork_settle_limit = 100000; //steps the startup settle may take before the search is skipped
+bool lattice = false; //build a solid block of cubes with build_lattice instead of the single cube
+const char* lattice_obj = nullptr; //watertight OBJ voxelized into that lattice instead of the block, e.g. "bunny.obj"
+const int voxel_resolution = 8; //cubes along the longest side of the voxelized mesh
+const int lattice_size = 3; //cubes per side of that block
+const float lattice_mass = 0.5f; //mass of every lattice vertex
+bool tetrahedra = false; //model the cube or lattice with corotated linear tetrahedra instead of springs, explicit path only
+const float tet_youngs = 40000.0f; //Young's modulus, roughly as stiff as the spring cube
+const float tet_poisson = 0.3f;
+const int tet_batch = 8; //tetrahedra processed side by side so the polar decomposition vectorizes
+const int polar_iterations = 8; //Newton iterations of the polar decomposition
+bool fracture = false; //remove springs that are strained past their max_strain
+bool rigid_clusters = false; //simulate groups of masses joined by very stiff springs as rigid bodies
+const float rigid_stiffness = 100000.0f; //springs at least this stiff are treated as rigid
+const int bvh_max_depth = 64; //size of the traversal stack, deeper nodes become leaves
+bool prune = false; //remove springs that add neither rigidity nor much stiffness before simulating
+bool rest_pose = false; //start from the static equilibrium found by solve_rest_pose instead of dropping the body
+const int newton_iterations = 50; //maximum Newton steps of solve_rest_pose
+const float rest_tolerance = 1e-4f; //largest force left on any mass at the rest pose
+const float prune_tolerance = 0.05f; //fraction of the effective stiffness pruning may lose
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void initialize_masses(vector<PointMass> &masses);
 void initialize_springs(vector<Spring> &springs);
-void apply_force(vector<PointMass> &masses);
-void update_pos_vel_acc(vector<PointMass> &masses);
-void update_forces(vector<PointMass> &masses, vector<Spring> &springs);
-void reset_forces(vector<PointMass> &masses);
-void update_breathing(vector<Spring> &springs);
+void initialize_bodies(vector<Body> &bodies, vector<PointMass> &masses, vector<Spring> &springs, vector<Tetrahedron> &tets);
+void apply_force(vector<PointMass> &masses, vector<Body> &bodies);
+void update_pos_vel_acc(vector<PointMass> &masses, vector<Body> &bodies);
+void update_forces(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Obstacle> &obstacles);
+void reset_forces(vector<PointMass> &masses, vector<Body> &bodies);
+void update_breathing(vector<Spring> &springs, vector<Body> &bodies);
+void update_sleep(vector<PointMass> &masses, vector<Body> &bodies);
+void wake_body(Body &body);
+int body_of_mass(vector<Body> &bodies, int m);
+int body_of_spring(vector<Body> &bodies, int s);
+Obstacle load_obstacle(const char* filename);
+vector<Triangle> load_obj(const char* filename);
+void build_bvh(Obstacle &obstacle);
+void obstacle_contact(PointMass &mass, vector<Obstacle> &obstacles);
+void build_rigid_clusters(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<RigidCluster> &clusters);
+void update_rigid_clusters(vector<PointMass> &masses, vector<Body> &bodies, vector<RigidCluster> &clusters);
+float stable_dt(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies);
+void build_modal_model(vector<PointMass> &masses, vector<Spring> &springs, ModalModel &model);
+void update_modal(ModalModel &model, vector<Spring> &springs);
+void modal_positions(ModalModel &model, vector<PointMass> &masses, int first, int last);
+float modal_energy(ModalModel &model);
+void build_multigrid(vector<PointMass> &masses, vector<Spring> &springs, Multigrid &mg);
+void update_implicit(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, Multigrid &mg);
+void update_fracture(vector<Spring> &springs, vector<Body> &bodies, Multigrid &mg);
+void initialize_pools(vector<PointMass> &masses, vector<Spring> &springs);
+void build_lattice(vector<char> &occupancy, int nx, int ny, int nz, float spacing, float origin[3], vector<PointMass> &masses, vector<Spring> &springs, vector<Tetrahedron> &tets);
+void compile_genome(Genome &genome, vector<Material> &materials, float spacing, float origin[3], vector<int> &vertex_id, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies);
+Genome voxelize(vector<Triangle> &triangles, int resolution, float &spacing, float origin[3]);
+void connect_within(vector<PointMass> &masses, float r, vector<Spring> &springs);
+void prune_springs(vector<PointMass> &masses, vector<Spring> &springs);
+void save_body(const char* filename, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies);
+MappedBody map_body(const char* filename);
+void load_body(MappedBody &body, vector<PointMass> &masses, vector<Spring> &springs);
+void unmap_body(MappedBody &body);
+void load_scene(const char* filename, vector<PointMass> &masses, vector<Spring> &springs);
+void load_cloud(const char* filename, vector<PointMass> &masses);
+void pack_state(vector<char> &buffer, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int iterations);
+void unpack_state(const char* buffer, size_t size, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int &iterations);
+void save_checkpoint(const char* filename, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int iterations);
+void load_checkpoint(const char* filename, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int &iterations);
+void step_headless(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Obstacle> &obstacles, SettleDetector &detector, int &iterations);
+bool update_settle(SettleDetector &detector, float kinetic, float max_speed);
+bool check_settle(SettleDetector &detector, vector<PointMass> &masses, vector<Body> &bodies);
+void settle_phase(SettleDetector &detector, vector<Spring> &springs, vector<Body> &bodies);
+int settle(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Obstacle> &obstacles, SettleDetector &detector, int &iterations, int max_steps);
+int solve_rest_pose(vector<PointMass> &masses, vector<Spring> &springs, bool &converged);
+template <typename T> T* ring_claim(Ring<T> &ring);
+template <typename T> void ring_publish(Ring<T> &ring);
+template <typename T> T* ring_front(Ring<T> &ring);
+template <typename T> void ring_release(Ring<T> &ring);
+void open_trajectory(TrajectoryRecorder &recorder, const char* filename, int num_masses, int num_springs, bool velocities, bool lengths, int stride, float tolerance);
+size_t encode_positions(TrajectoryCodec &codec, const float* positions, int num_masses, char* out);
+size_t decode_positions(TrajectoryCodec &codec, const char* in, int num_masses, float* positions);
+void write_quantized_frame(TrajectoryRecorder &recorder, vector<char> &frame);
+void record_frame(TrajectoryRecorder &recorder, vector<PointMass> &masses, vector<Spring> &springs);
+void close_trajectory(TrajectoryRecorder &recorder);
+MappedTrajectory map_trajectory(const char* filename);
+const float* trajectory_column(MappedTrajectory &trajectory, int frame, int column);
+void trajectory_positions(MappedTrajectory &trajectory, TrajectoryCodec &cursor, int frame, float* positions);
+void unmap_trajectory(MappedTrajectory &trajectory);
+void open_export(SequenceExporter &exporter, const char* prefix, int num_masses, int num_springs);
+void export_frame(SequenceExporter &exporter, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies);
+void write_vtk(const char* filename, ExportFrame &frame, vector<char> &staging);
+void close_export(SequenceExporter &exporter);
+void open_telemetry(Telemetry &telemetry, const char* filename);
+bool push_sample(Telemetry &telemetry, TelemetrySample &sample);
+void close_telemetry(Telemetry &telemetry);
+void open_shared_state(SharedState &shared, const char* name, int capacity);
+void publish_state(SharedState &shared, vector<PointMass> &masses, vector<Body> &bodies, TelemetrySample &sample);
+void map_shared_state(SharedState &shared, const char* name);
+const SharedStateBuffer* begin_read_state(SharedState &shared, uint64_t &sequence);
+bool end_read_state(const SharedStateBuffer* buffer, uint64_t sequence);
+const float* shared_positions(const SharedStateBuffer* buffer);
+TelemetrySample read_state(SharedState &shared, vector<float> &positions);
+void close_shared_state(SharedState &shared);
+void open_stream_server(StreamServer &server, const char* path);
+bool push_stream_frame(StreamServer &server, StreamFrame &frame);
+void close_stream_server(StreamServer &server);
+int connect_stream(const char* path);
+bool read_stream_frame(int fd, StreamFrame &frame);
+void restore_fork(const vector<char> &snapshot, Controller &controller, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int &iterations);
+vector<float> evaluate_forks(const vector<char> &snapshot, vector<Controller> &controllers, int steps);
+void add_tetrahedron(vector<PointMass> &masses, vector<Tetrahedron> &tets, int a, int b, int c, int d);
+void add_cube_tets(vector<PointMass> &masses, vector<Tetrahedron> &tets, int corners[8], int parity);
+void update_tet_forces(vector<PointMass> &masses, vector<Tetrahedron> &tets, vector<Body> &bodies);
+int next_mass_start(vector<PointMass> &masses, vector<Body> &bodies, int b);
+int pool_slot(Pool &pool, Handle handle);
+Handle pool_handle(Pool &pool, int slot);
+Handle add_mass(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters, int body, PointMass &mass);
+Handle add_spring(vector<Spring> &springs, vector<Body> &bodies, int body, Spring &spring);
+void remove_mass(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters, Handle handle);
+Handle attach_payload(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters, int body);
+void remove_spring(vector<Spring> &springs, vector<Body> &bodies, Handle handle);
+bool has_gaps(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies);
+void compact_pools(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters);
 
 const unsigned int width = 1000;
 const unsigned int height = 1000;
@@ -167,13 +737,171 @@ int main(int argc, const char * argv[]) {
         }
       }
     
+    if (tetrahedra && (scene_file || body_file || save_body_file || cloud_file || implicit || modal || rest_pose)){
+        std::cout << "Tetrahedra need cubes to split and only run on the explicit path: use the cube or a lattice, without implicit, modal, rest_pose or body files" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    
+    if (fork_controllers > 0 && (modal || implicit || rigid_clusters || tetrahedra)){
+        std::cout << "The forked controller search steps spring bodies explicitly: turn off modal, implicit, rigid_clusters and tetrahedra" << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    
+    if (sleeping){
+        contact_damping = sleep_contact_damping; //bodies only come to rest if contact and vibration lose energy
+        spring_damping = sleep_spring_damping;
+    }
+    if (modal){
+        contact_damping = max(contact_damping, modal_contact_damping); //otherwise the settle detector never fires and breathing never starts
+    }
+    
     vector<PointMass> masses;
     vector<Spring> springs;
-    initialize_masses(masses);
-    initialize_springs(springs);
+    vector<Tetrahedron> tets;
+    if (scene_file){
+        load_scene(scene_file, masses, springs);
+    }
+    else if (body_file){
+        MappedBody mapped = map_body(body_file);
+        load_body(mapped, masses, springs);
+        unmap_body(mapped);
+    }
+    else if (cloud_file){
+        load_cloud(cloud_file, masses);
+        breathing_springs.clear();
+        connect_within(masses, cloud_radius, springs);
+    }
+    else if (lattice && lattice_obj){
+        vector<Triangle> triangles = load_obj(lattice_obj);
+        float spacing;
+        float origin[3];
+        Genome genome = voxelize(triangles, voxel_resolution, spacing, origin);
+        build_lattice(genome.voxels, genome.nx, genome.ny, genome.nz, spacing, origin, masses, springs, tets);
+    }
+    else if (lattice){
+        vector<char> occupancy(lattice_size*lattice_size*lattice_size, 1);
+        float origin[3] = {-0.25f, -0.25f, 1.0f};
+        build_lattice(occupancy, lattice_size, lattice_size, lattice_size, 0.5f, origin, masses, springs, tets); //no actuated material, so breathing_springs ends up empty
+    }
+    else{
+        initialize_masses(masses);
+        initialize_springs(springs);
+        if (tetrahedra){
+            //5 tetrahedra replace the 28 springs of the cube, corners in x, y, z bit order
+            int corners[8] = {0, 3, 1, 2, 4, 7, 5, 6};
+            add_cube_tets(masses, tets, corners, 0);
+            springs.clear();
+            breathing_springs.clear();
+        }
+    }
+    if (masses.size() < 8){
+        std::cout << "The render loop draws the cube through masses 0 to 7, but the body only has " << masses.size() << std::endl;
+        glfwTerminate();
+        return -1;
+    }
+    if (prune){
+        prune_springs(masses, springs);
+    }
+    if (rest_pose){
+        bool converged;
+        int taken = solve_rest_pose(masses, springs, converged);
+        if (converged){
+            cout << "Rest pose after " << taken << " Newton iterations" << endl;
+        }
+        else{
+            cout << "Rest pose did not converge in " << taken << " Newton iterations, kept the last pose that lowered the energy" << endl;
+        }
+    }
+    
+    vector<Body> bodies;
+    initialize_bodies(bodies, masses, springs, tets);
+    initialize_pools(masses, springs);
+    for (int t=0; t<tets.size(); t++){
+        tets[t].body = body_of_mass(bodies, tets[t].m[0]);
+    }
+    if (save_body_file){
+        save_body(save_body_file, masses, springs, bodies); //after pruning and the rest pose, so loading it skips both
+        cout << "Saved body to " << save_body_file << endl;
+    }
+    
+    //The modes describe the body at rest, so they are built before a checkpoint moves it, and modal mode never
+    //adds, removes or breaks anything that would make the checkpoint's layout differ
+    ModalModel model;
+    if (modal){
+        build_modal_model(masses, springs, model);
+    }
     
     float prev_T = 0;
     int iterations = 0;
+    SettleDetector settle_detector; //actuation starts once the dropped body has come to rest
+    Handle payload = {-1, 0}; //mass put on with the P key, stale while there is none
+    if (checkpoint_file && ifstream(checkpoint_file)){
+        load_checkpoint(checkpoint_file, masses, springs, bodies, model, settle_detector, iterations);
+    }
+    
+    //Built from the restored arrays, which may have lost springs to fracture or been compacted since the start
+    vector<RigidCluster> clusters;
+    if (rigid_clusters){
+        build_rigid_clusters(masses, springs, bodies, clusters);
+        cout << "Rigid clusters: " << clusters.size() << ", largest stable dt: " << stable_dt(masses, springs, bodies) << endl;
+    }
+    
+    Multigrid mg;
+    if (implicit){
+        build_multigrid(masses, springs, mg);
+    }
+    
+    vector<Obstacle> obstacles;
+    if (obstacle_file){
+        obstacles.push_back(load_obstacle(obstacle_file));
+    }
+    
+    //Controller search: settle without drawing, then run shifted phase patterns from the settled state in forked
+    //children and keep the one that moves the body farthest. It comes before any writer thread is started,
+    //since evaluate_forks refuses to fork while one runs
+    //-------------------------------------
+    if (breathing && fork_controllers > 0){
+        settle(masses, springs, bodies, obstacles, settle_detector, iterations, fork_settle_limit);
+        if (settle_detector.settled){
+            vector<char> snapshot;
+            pack_state(snapshot, masses, springs, bodies, model, settle_detector, iterations);
+            vector<Controller> controllers(fork_controllers);
+            for (int c=0; c<fork_controllers; c++){
+                for (int a=0; a<breathing_springs.size(); a++){
+                    int i = breathing_springs[a];
+                    controllers[c].amplitude.push_back(i >= 0 ? springs[i].amplitude : 0.0f);
+                    controllers[c].phase.push_back(i >= 0 ? springs[i].phase + 2.0f*(float)M_PI*c*(a + 1)/fork_controllers : 0.0f); //controller 0 is the current one
+                }
+            }
+            vector<float> distances = evaluate_forks(snapshot, controllers, fork_steps);
+            int best = 0;
+            for (int c=1; c<fork_controllers; c++){
+                if (distances[c] > distances[best] || isnan(distances[best])){
+                    best = c;
+                }
+            }
+            for (int a=0; a<breathing_springs.size(); a++){
+                if (breathing_springs[a] >= 0){
+                    springs[breathing_springs[a]].phase = controllers[best].phase[a];
+                }
+            }
+            cout << "Controller " << best << " of " << fork_controllers << " moved " << distances[best] << " in " << fork_steps << " steps" << endl;
+        }
+        else{
+            cout << "Did not settle in " << fork_settle_limit << " steps, skipped the controller search" << endl;
+        }
+    }
+    //-------------------------------------
+    TrajectoryRecorder recorder;
+    if (trajectory_file){
+        open_trajectory(recorder, trajectory_file, (int)masses.size(), (int)springs.size(), record_velocities, record_lengths, trajectory_stride, trajectory_tolerance);
+    }
+    SequenceExporter exporter;
+    if (export_prefix){
+        open_export(exporter, export_prefix, (int)masses.size(), (int)springs.size());
+    }
     
     float x0 = masses[0].position[0];
     float y0 = masses[0].position[1];
@@ -200,9 +928,19 @@ int main(int argc, const char * argv[]) {
     float y7 = masses[7].position[1];
     float z7 = masses[7].position[2];
     
-    vector<float> PE; //total potential energy of the system
-    vector<float> KE; //total kinetic energy of the system
-    vector<float> TE; //total energy of the system
+    Telemetry telemetry; //potential, kinetic and total energy of the system, streamed to telemetry_file
+    if (telemetry_file){
+        open_telemetry(telemetry, telemetry_file);
+    }
+    SharedState shared; //live state for other processes
+    if (shared_state_name){
+        open_shared_state(shared, shared_state_name, (int)masses.size());
+    }
+    StreamServer stream; //telemetry frames for local subscribers
+    if (stream_socket){
+        open_stream_server(stream, stream_socket);
+    }
+    float step_time = 0; //wall-clock ms of the last step
     
     // render loop
     while(!glfwWindowShouldClose(window))
@@ -215,6 +953,14 @@ int main(int argc, const char * argv[]) {
         
         processInput(window);
         
+        //P puts a payload on top of the first body, O takes it off again
+        if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS && pool_slot(mass_pool, payload) < 0 && !implicit && !modal){
+            payload = attach_payload(masses, springs, bodies, tets, clusters, 0);
+        }
+        if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS && pool_slot(mass_pool, payload) >= 0){
+            remove_mass(masses, springs, bodies, tets, clusters, payload);
+        }
+        
         // render
         // ------
         glClearColor(0.1f, 0.3f, 0.4f, 1.0f);
@@ -248,19 +994,69 @@ int main(int argc, const char * argv[]) {
         //Update the forces, acceleration, velocity, and position
         //-------------------------------------
 //        if (T == 0){
-//            apply_force(masses); //apply spinning force (optional)
+//            apply_force(masses, bodies); //apply spinning force (optional)
 //        }
 //        if (breathing) {
-//            update_breathing(springs);
+//            update_breathing(springs, bodies);
 //        }
+        auto step_start = chrono::steady_clock::now();
+        settle_phase(settle_detector, springs, bodies);
 
-        update_forces(masses, springs);
-        update_pos_vel_acc(masses);
+        if (modal){
+            update_modal(model, springs);
+            //rebuilding a mass costs O(K^2), so all of them only when the energy sample or a recorder reads them next,
+            //otherwise just the cube corners the render update reads
+            bool sampled = iterations % 10 == 0 || (trajectory_file && recorder.step % recorder.header.stride == 0) || (export_prefix && exporter.step % export_stride == 0);
+            modal_positions(model, masses, 0, sampled ? (int)masses.size() : min(8, (int)masses.size()));
+        }
+        else if (implicit){
+            update_forces(masses, springs, bodies, obstacles);
+            if (fracture){
+                update_fracture(springs, bodies, mg);
+            }
+            update_implicit(masses, springs, bodies, mg);
+            if (rigid_clusters){
+                update_rigid_clusters(masses, bodies, clusters); //rigid springs are left out of A, the clusters move as a whole
+            }
+        }
+        else{
+            update_forces(masses, springs, bodies, obstacles);
+            if (tetrahedra){
+                update_tet_forces(masses, tets, bodies);
+            }
+            if (fracture){
+                update_fracture(springs, bodies, mg);
+            }
+            update_pos_vel_acc(masses, bodies);
+            if (rigid_clusters){
+                update_rigid_clusters(masses, bodies, clusters);
+            }
+            if (sleeping){
+                update_sleep(masses, bodies);
+            }
+        }
+        step_time = chrono::duration<float, milli>(chrono::steady_clock::now() - step_start).count();
         //-------------------------------------
         
         prev_T = T;
         T = T + dt; //update time that has passed
         
+        //close the gaps left by removed masses and springs while nothing is moving, or every compact_interval steps,
+        //the multigrid hierarchy and the modal basis are laid out per mass slot at startup, so those keep their gaps
+        bool idle = true;
+        for (int b_i=0; b_i<bodies.size(); b_i++){
+            idle = idle && bodies[b_i].asleep;
+        }
+        if (!implicit && !modal && (idle || iterations % compact_interval == 0) && has_gaps(masses, springs, bodies)){
+            compact_pools(masses, springs, bodies, tets, clusters);
+        }
+        if (trajectory_file){
+            record_frame(recorder, masses, springs);
+        }
+        if (export_prefix){
+            export_frame(exporter, masses, springs, bodies);
+        }
+        
         //Update the position on the actual simulator only after every 50 simulations
         //-------------------------------------
         if (iterations % 1 == 0){
@@ -297,32 +1093,65 @@ int main(int argc, const char * argv[]) {
             float total_KE = 0;
             float total_PE = 0;
             float total_E = 0;
+            float max_speed_2 = 0;
+            double total_mass = 0;
+            double center[3] = {0, 0, 0};
             
-            for (int j=0; j<8; j++){
-                float v_x = masses[j].velocity[0];
-                float v_y = masses[j].velocity[1];
-                float v_z = masses[j].velocity[2];
+            for (int b_i=0; b_i<bodies.size(); b_i++){
+                int first_mass = bodies[b_i].first_mass;
+                for (int j=first_mass; j<first_mass+bodies[b_i].num_masses; j++){
+                    float v_x = masses[j].velocity[0];
+                    float v_y = masses[j].velocity[1];
+                    float v_z = masses[j].velocity[2];
+                    
+                    total_KE += 0.5 * masses[j].mass * (pow(v_x, 2) + pow(v_y, 2) + pow(v_z, 2));
+                    max_speed_2 = max(max_speed_2, v_x*v_x + v_y*v_y + v_z*v_z);
+                    
+                    total_mass += masses[j].mass;
+                    for (int n=0; n<3; n++){
+                        center[n] += masses[j].mass*masses[j].position[n];
+                    }
+                    
+                    float p_z = masses[j].position[2];
+                    
+                    total_PE += masses[j].mass * 9.81 * p_z;
+                }
                 
-                total_KE += 0.5 * masses[j].mass * (pow(v_x, 2) + pow(v_y, 2) + pow(v_z, 2));
-                
-                float p_z = masses[j].position[2];
-
-                total_PE += masses[j].mass * 9.81 * p_z;
+                if (modal){
+                    continue; //the spring lengths are not updated, the elastic energy is added below
+                }
+                int first_spring = bodies[b_i].first_spring;
+                for (int k=first_spring; k<first_spring+bodies[b_i].num_springs; k++){
+                    float L = springs[k].L;
+                    float L0 = springs[k].L0;
+                    
+                    total_PE += 0.5 * springs[k].k * pow(L-L0, 2);
+                }
             }
-            
-            for (int k=0; k<28; k++){
-                float L = springs[k].L;
-                float L0 = springs[k].L0;
-                
-                total_PE += 0.5 * springs[k].k * pow(L-L0, 2);
+            if (modal){
+                total_PE += modal_energy(model);
+            }
+            for (int t=0; t<tets.size(); t++){
+                total_PE += tets[t].energy;
             }
             total_E = total_PE + total_KE;
             
-            PE.push_back(total_PE);
-            KE.push_back(total_KE);
-            TE.push_back(total_E);
+            TelemetrySample sample = {iterations, T, total_PE, total_KE, total_E, sqrt(max_speed_2)};
+            if (telemetry_file){
+                push_sample(telemetry, sample);
+            }
+            if (shared_state_name){
+                publish_state(shared, masses, bodies, sample);
+            }
+            if (stream_socket){
+                StreamFrame frame = {sizeof(StreamFrame), stream_version, iterations, T, total_PE, total_KE, total_E,
+                    {(float)(center[0]/total_mass), (float)(center[1]/total_mass), (float)(center[2]/total_mass)}, contact_count, step_time};
+                push_stream_frame(stream, frame);
+            }
             
-            cout << "Calculated Energy in System" << endl;
+            if (!settle_detector.settled && check_settle(settle_detector, masses, bodies)){
+                cout << "Settled after " << iterations << " iterations" << endl;
+            }
         }
         //-------------------------------------
         
@@ -388,7 +1217,7 @@ int main(int argc, const char * argv[]) {
         VBO1.Delete();
         EBO1.Delete();
         
-        reset_forces(masses);
+        reset_forces(masses, bodies);
         iterations += 1;
         cout << iterations << endl;
         
@@ -404,41 +1233,27 @@ int main(int argc, const char * argv[]) {
 
     glfwTerminate();
     
-    cout << "Potential Energy: ";
-    for (int m=0; m<PE.size(); m++){
-        if (m==0){
-            cout << "[";
-        }
-        cout << PE[m];
-        if (m < PE.size()-1){
-            cout << ", ";
-        }
+    if (trajectory_file){
+        close_trajectory(recorder);
     }
-    cout << "]" << endl;
-    
-    cout << "Kinetic Energy: ";
-    for (int n=0; n<KE.size(); n++){
-        if (n==0){
-            cout << "[";
-        }
-        cout << KE[n];
-        if (n < KE.size()-1){
-            cout << ", ";
-        }
+    if (export_prefix){
+        close_export(exporter);
+        cout << "Exported " << exporter.frames << " frames, dropped " << exporter.dropped << endl;
     }
-    cout << "]" << endl;
-    
-    cout << "Total Energy: ";
-    for (int p=0; p<TE.size(); p++){
-        if (p==0){
-            cout << "[";
-        }
-        cout << TE[p];
-        if (p < TE.size()-1){
-            cout << ", ";
-        }
+    if (checkpoint_file){
+        save_checkpoint(checkpoint_file, masses, springs, bodies, model, settle_detector, iterations);
+    }
+    if (telemetry_file){
+        close_telemetry(telemetry);
+        cout << "Wrote " << telemetry.samples << " energy samples to " << telemetry_file << ", dropped " << telemetry.dropped << endl;
+    }
+    if (shared_state_name){
+        close_shared_state(shared);
+    }
+    if (stream_socket){
+        close_stream_server(stream);
+        cout << "Telemetry stream dropped " << stream.dropped << " frames" << endl;
     }
-    cout << "]" << endl;
     
     return 0;
 }
@@ -794,7 +1609,96 @@ void initialize_springs(vector<Spring> &springs){
     springs = {spring0, spring1, spring2, spring3, spring4, spring5, spring6, spring7, spring8, spring9, spring10, spring11, spring12, spring13, spring14, spring15, spring16, spring17, spring18, spring19, spring20, spring21, spring22, spring23, spring24, spring25, spring26, spring27};
 }
 
-void apply_force(vector<PointMass> &masses){
+void initialize_bodies(vector<Body> &bodies, vector<PointMass> &masses, vector<Spring> &springs, vector<Tetrahedron> &tets){
+    //Every run of consecutive masses that no spring or tetrahedron connects to the rest is its own body,
+    //so separate objects sleep and wake on their own. Springs are regrouped by body, the masses keep their order
+    //----------------------
+    int num_masses = (int)masses.size();
+    vector<int> reach(num_masses); //highest mass index connected to each mass
+    for (int i=0; i<num_masses; i++){
+        reach[i] = i;
+    }
+    for (Spring &spring : springs){
+        int low = min(spring.m0, spring.m1);
+        reach[low] = max(reach[low], max(spring.m0, spring.m1));
+    }
+    for (Tetrahedron &tet : tets){
+        int low = *min_element(tet.m, tet.m + 4);
+        reach[low] = max(reach[low], *max_element(tet.m, tet.m + 4));
+    }
+    bodies.clear();
+    vector<int> body_of(num_masses);
+    int end = 0;
+    for (int i=0; i<num_masses; i++){
+        if (i == 0 || i > end){
+            Body body;
+            body.first_mass = i;
+            body.num_masses = 0;
+            body.first_spring = 0;
+            body.num_springs = 0;
+            body.asleep = false;
+            body.still_steps = 0;
+            bodies.push_back(body);
+        }
+        end = max(end, reach[i]);
+        bodies.back().num_masses += 1;
+        body_of[i] = (int)bodies.size() - 1;
+    }
+    //----------------------
+    
+    //Stable counting sort of the springs by body, the actuated springs follow their springs
+    //----------------------
+    for (Spring &spring : springs){
+        bodies[body_of[spring.m0]].num_springs += 1;
+    }
+    int first = 0;
+    for (Body &body : bodies){
+        body.first_spring = first;
+        first += body.num_springs;
+    }
+    vector<int> fill(bodies.size());
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        fill[b_i] = bodies[b_i].first_spring;
+    }
+    vector<Spring> sorted(springs.size());
+    vector<int> remap(springs.size());
+    for (int i=0; i<springs.size(); i++){
+        remap[i] = fill[body_of[springs[i].m0]]++;
+        sorted[remap[i]] = springs[i];
+    }
+    springs.swap(sorted);
+    for (int &a : breathing_springs){
+        if (a >= 0 && a < remap.size()){
+            a = remap[a];
+        }
+    }
+    //----------------------
+}
+
+int body_of_mass(vector<Body> &bodies, int m){
+    for (int i=0; i<bodies.size(); i++){
+        if (m >= bodies[i].first_mass && m < bodies[i].first_mass + bodies[i].num_masses){
+            return i;
+        }
+    }
+    return -1;
+}
+
+int body_of_spring(vector<Body> &bodies, int s){
+    for (int i=0; i<bodies.size(); i++){
+        if (s >= bodies[i].first_spring && s < bodies[i].first_spring + bodies[i].num_springs){
+            return i;
+        }
+    }
+    return -1;
+}
+
+void wake_body(Body &body){
+    body.asleep = false;
+    body.still_steps = 0;
+}
+
+void apply_force(vector<PointMass> &masses, vector<Body> &bodies){
 //    for (int i=0; i<4; i++){
 //        masses[i].forces[2] = 1000000.0f;
 //    }
@@ -802,89 +1706,4822 @@ void apply_force(vector<PointMass> &masses){
     masses[1].forces[1] = 5000.0f;
     masses[2].forces[1] = -5000.0f;
     masses[3].forces[1] = -5000.0f;
+    
+    //an external force wakes the body it is applied to
+    for (int i=0; i<4; i++){
+        int body = body_of_mass(bodies, i);
+        if (body >= 0){
+            wake_body(bodies[body]);
+        }
+    }
 }
 
-void update_pos_vel_acc(vector<PointMass> &masses){
+void update_pos_vel_acc(vector<PointMass> &masses, vector<Body> &bodies){
     
-    for (int i=0; i<8; i++){
-        float acc_x = masses[i].forces[0]/masses[i].mass;
-        float acc_y = masses[i].forces[1]/masses[i].mass;
-        float acc_z = masses[i].forces[2]/masses[i].mass;
-
-        masses[i].acceleration[0] = acc_x;
-        masses[i].acceleration[1] = acc_y;
-        masses[i].acceleration[2] = acc_z;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        if (bodies[b_i].asleep){
+            continue;
+        }
+        int first = bodies[b_i].first_mass;
+        int last = first + bodies[b_i].num_masses;
         
-        float vel_x = acc_x*dt + masses[i].velocity[0];
-        float vel_y = acc_y*dt + masses[i].velocity[1];
-        float vel_z = acc_z*dt + masses[i].velocity[2];
+        for (int i=first; i<last; i++){
+            if (masses[i].cluster >= 0){
+                continue; //moved by update_rigid_clusters
+            }
+            float acc_x = masses[i].forces[0]/masses[i].mass;
+            float acc_y = masses[i].forces[1]/masses[i].mass;
+            float acc_z = masses[i].forces[2]/masses[i].mass;
+            
+            masses[i].acceleration[0] = acc_x;
+            masses[i].acceleration[1] = acc_y;
+            masses[i].acceleration[2] = acc_z;
+            
+            float vel_x = acc_x*dt + masses[i].velocity[0];
+            float vel_y = acc_y*dt + masses[i].velocity[1];
+            float vel_z = acc_z*dt + masses[i].velocity[2];
+            if (damped){
+                vel_x *= b;
+                vel_y *= b;
+                vel_z *= b;
+            }
+            
+            masses[i].velocity[0] = vel_x;
+            masses[i].velocity[1] = vel_y;
+            masses[i].velocity[2] = vel_z;
+            
+//            float pos_x = 0.5*acc_x*pow(dt, 2) + (vel_x*dt) + masses[i].position[0];
+//            float pos_y = 0.5*acc_y*pow(dt, 2) + (vel_y*dt) + masses[i].position[1];
+//            float pos_z = 0.5*acc_z*pow(dt, 2) + (vel_z*dt) + masses[i].position[2];
+            float pos_x = (vel_x*dt) + masses[i].position[0];
+            float pos_y = (vel_y*dt) + masses[i].position[1];
+            float pos_z = (vel_z*dt) + masses[i].position[2];
+            
+            masses[i].position[0] = pos_x;
+            masses[i].position[1] = pos_y;
+            masses[i].position[2] = pos_z;
+        }
+    }
+}
+
+void reset_forces(vector<PointMass> &masses, vector<Body> &bodies){
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        if (bodies[b_i].asleep){
+            continue;
+        }
+        int first = bodies[b_i].first_mass;
+        int last = first + bodies[b_i].num_masses;
         
+        for(int i=first; i<last; i++){
+            masses[i].forces = {0.0f, 0.0f, 0.0f};
+        }
+    }
+}
+
+void update_forces(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Obstacle> &obstacles){
+    
+    contact_count = 0;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        if (bodies[b_i].asleep){
+            continue;
+        }
+        int first_spring = bodies[b_i].first_spring;
+        int last_spring = first_spring + bodies[b_i].num_springs;
         
-        masses[i].velocity[0] = vel_x;
-        masses[i].velocity[1] = vel_y;
-        masses[i].velocity[2] = vel_z;
+        for (int i=first_spring; i<last_spring; i++){
+            if (springs[i].rigid){
+                continue;
+            }
+            
+            int p0 = springs[i].m0;
+            int p1 = springs[i].m1;
+            
+            vector<float> pos0 = masses[p0].position;
+            vector<float> pos1 = masses[p1].position;
+            
+            float spring_length = sqrt(pow(pos1[0]-pos0[0], 2) + pow(pos1[1]-pos0[1], 2) + pow(pos1[2]-pos0[2], 2));
+            
+            springs[i].L = spring_length;
+            float force = -springs[i].k*(spring_length-springs[i].L0);
+            
+            float x_univ = (pos0[0]-pos1[0])/spring_length;
+            float y_univ = (pos0[1]-pos1[1])/spring_length;
+            float z_univ = (pos0[2]-pos1[2])/spring_length;
+            if (spring_damping > 0){
+                //dashpot along the spring, only the ends moving apart or together lose energy
+                float reduced_mass = masses[p0].mass*masses[p1].mass/(masses[p0].mass + masses[p1].mass);
+                float closing = (masses[p0].velocity[0]-masses[p1].velocity[0])*x_univ + (masses[p0].velocity[1]-masses[p1].velocity[1])*y_univ + (masses[p0].velocity[2]-masses[p1].velocity[2])*z_univ;
+                force -= spring_damping*2.0f*sqrt(springs[i].k*reduced_mass)*closing;
+            }
+            vector<float> force_unit_dir_2_1 = {x_univ,y_univ,z_univ};
+            vector<float> force_unit_dir_1_2 = {-x_univ,-y_univ,-z_univ};
+            
+            for (int n = 0; n < 3; n++) {
+                masses[p0].forces[n] =  masses[p0].forces[n] + force * force_unit_dir_2_1[n];
+                masses[p1].forces[n] =  masses[p1].forces[n] + force * force_unit_dir_1_2[n];
+            }
+        }
         
-//        float pos_x = 0.5*acc_x*pow(dt, 2) + (vel_x*dt) + masses[i].position[0];
-//        float pos_y = 0.5*acc_y*pow(dt, 2) + (vel_y*dt) + masses[i].position[1];
-//        float pos_z = 0.5*acc_z*pow(dt, 2) + (vel_z*dt) + masses[i].position[2];
-        float pos_x = (vel_x*dt) + masses[i].position[0];
-        float pos_y = (vel_y*dt) + masses[i].position[1];
-        float pos_z = (vel_z*dt) + masses[i].position[2];
+        int first_mass = bodies[b_i].first_mass;
+        int last_mass = first_mass + bodies[b_i].num_masses;
         
-        masses[i].position[0] = pos_x;
-        masses[i].position[1] = pos_y;
-        masses[i].position[2] = pos_z;
+        for (int j=first_mass; j<last_mass; j++){
+            masses[j].forces[2] = masses[j].forces[2] + masses[j].mass*g;
+            
+            bool touching = masses[j].position[2] < 0;
+            if (masses[j].position[2] < 0){
+                //spring and dashpot, the ground only pushes and takes energy out of every bounce
+                float damping = contact_damping*2.0f*sqrt(ground_stiffness*masses[j].mass);
+                masses[j].forces[2] = max(0.0f, -masses[j].position[2]*ground_stiffness - damping*masses[j].velocity[2]);
+                
+//                cout << masses[j].velocity[2] << endl;
+//                masses[j].forces[2] = masses[j].forces[2]-(masses[j].mass * masses[j].velocity[2])/dt;
+            }
+            
+            if (!obstacles.empty()){
+                obstacle_contact(masses[j], obstacles);
+                touching = touching || masses[j].last_obstacle >= 0;
+            }
+            contact_count += touching;
+        }
     }
 }
 
-void reset_forces(vector<PointMass> &masses){
-    for(int i=0; i<8; i++){
-        masses[i].forces = {0.0f, 0.0f, 0.0f};
+void update_breathing(vector<Spring> &springs, vector<Body> &bodies){
+    for (int i : breathing_springs){
+        if (i < 0){
+            continue;
+        }
+        springs[i].L0 = springs[i].original_L0 + springs[i].amplitude*sin(100.0f*T + springs[i].phase);
+        
+        //changing the actuation wakes the body the spring belongs to, so an actuated body never sleeps
+        int body = springs[i].amplitude != 0.0f ? body_of_spring(bodies, i) : -1;
+        if (body >= 0){
+            wake_body(bodies[body]);
+        }
     }
 }
 
-void update_forces(vector<PointMass> &masses, vector<Spring> &springs){
+void update_sleep(vector<PointMass> &masses, vector<Body> &bodies){
     
-    for (int i=0; i<28; i++){
+    //Put awake bodies that have been resting for sleep_steps steps to sleep
+    //-------------------------------------
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        Body &body = bodies[b_i];
+        if (body.asleep){
+            continue;
+        }
+        int first = body.first_mass;
+        int last = first + body.num_masses;
         
-        int p0 = springs[i].m0;
-        int p1 = springs[i].m1;
-
-        vector<float> pos0 = masses[p0].position;
-        vector<float> pos1 = masses[p1].position;
-
-        float spring_length = sqrt(pow(pos1[0]-pos0[0], 2) + pow(pos1[1]-pos0[1], 2) + pow(pos1[2]-pos0[2], 2));
-
-        springs[i].L = spring_length;
-        float force = -springs[i].k*(spring_length-springs[i].L0);
-
-        float x_univ = (pos0[0]-pos1[0])/spring_length;
-        float y_univ = (pos0[1]-pos1[1])/spring_length;
-        float z_univ = (pos0[2]-pos1[2])/spring_length;
-        vector<float> force_unit_dir_2_1 = {x_univ,y_univ,z_univ};
-        vector<float> force_unit_dir_1_2 = {-x_univ,-y_univ,-z_univ};
-
-        for (int n = 0; n < 3; n++) {
-            masses[p0].forces[n] =  masses[p0].forces[n] + force * force_unit_dir_2_1[n];
-            masses[p1].forces[n] =  masses[p1].forces[n] + force * force_unit_dir_1_2[n];
+        float kinetic = 0;
+        float total_mass = 0;
+        float max_speed_2 = 0;
+        for (int i=first; i<last; i++){
+            float speed_2 = pow(masses[i].velocity[0], 2) + pow(masses[i].velocity[1], 2) + pow(masses[i].velocity[2], 2);
+            kinetic += 0.5 * masses[i].mass * speed_2;
+            total_mass += masses[i].mass;
+            max_speed_2 = max(max_speed_2, speed_2);
+        }
+        
+        if (kinetic < 0.5f*total_mass*sleep_rms_velocity*sleep_rms_velocity && max_speed_2 < sleep_velocity*sleep_velocity){
+            body.still_steps += 1;
+        }
+        else{
+            body.still_steps = 0;
+        }
+        
+        if (body.still_steps >= sleep_steps){
+            body.asleep = true;
+            for (int i=first; i<last; i++){
+                masses[i].velocity = {0.0f, 0.0f, 0.0f};
+                masses[i].acceleration = {0.0f, 0.0f, 0.0f};
+                masses[i].forces = {0.0f, 0.0f, 0.0f};
+            }
+        }
+        
+        //bounding box of the body, kept while it sleeps and used below for contact
+        for (int n=0; n<3; n++){
+            body.box_min[n] = INFINITY;
+            body.box_max[n] = -INFINITY;
+        }
+        for (int i=first; i<last; i++){
+            for (int n=0; n<3; n++){
+                body.box_min[n] = min(body.box_min[n], masses[i].position[n]);
+                body.box_max[n] = max(body.box_max[n], masses[i].position[n]);
+            }
         }
     }
+    //-------------------------------------
     
-    for (int j=0; j<8; j++){
-        masses[j].forces[2] = masses[j].forces[2] + masses[j].mass*g;
-        
-        if (masses[j].position[2] < 0){
-            masses[j].forces[2] = -masses[j].position[2]*1000000.0f;
-            
-//            cout << masses[j].velocity[2] << endl;
-//            masses[j].forces[2] = masses[j].forces[2]-(masses[j].mass * masses[j].velocity[2])/dt;
+    //Wake sleeping bodies that an awake body has come into contact with
+    //-------------------------------------
+    for (int a=0; a<bodies.size(); a++){
+        if (bodies[a].asleep){
+            continue;
+        }
+        for (int s=0; s<bodies.size(); s++){
+            if (!bodies[s].asleep){
+                continue;
+            }
+            bool overlap = true;
+            for (int n=0; n<3; n++){
+                if (bodies[a].box_max[n] + sleep_margin < bodies[s].box_min[n] || bodies[s].box_max[n] + sleep_margin < bodies[a].box_min[n]){
+                    overlap = false;
+                }
+            }
+            if (overlap){
+                wake_body(bodies[s]);
+            }
         }
     }
+    //-------------------------------------
 }
 
-void update_breathing(vector<Spring> &springs){
-    for (int i=24; i<28; i++){
-        springs[i].L0 = springs[i].original_L0 + 0.25f*sin(100.0f*T);
+Obstacle load_obstacle(const char* filename){
+    Obstacle obstacle;
+    obstacle.triangles = load_obj(filename);
+    build_bvh(obstacle);
+    return obstacle;
+}
+
+vector<Triangle> load_obj(const char* filename){
+    //Read the vertices and faces of a Wavefront OBJ file, faces with more than 3 corners are fanned
+    //-------------------------------------
+    string contents = get_file_contents(filename);
+    istringstream in(contents);
+    
+    vector<float> vertices;
+    vector<Triangle> triangles;
+    string line;
+    while (getline(in, line)){
+        istringstream words(line);
+        string type;
+        words >> type;
+        
+        if (type == "v"){
+            float x, y, z;
+            words >> x >> y >> z;
+            vertices.insert(vertices.end(), {x, y, z});
+        }
+        else if (type == "f"){
+            vector<int> corners;
+            string corner;
+            while (words >> corner){
+                int index = stoi(corner.substr(0, corner.find('/')));
+                corners.push_back(index < 0 ? (int)vertices.size()/3 + index : index - 1); //OBJ indices start at 1, negative ones are relative
+            }
+            for (int c=1; c+1<corners.size(); c++){
+                Triangle triangle;
+                for (int n=0; n<3; n++){
+                    triangle.v0[n] = vertices[3*corners[0] + n];
+                    triangle.v1[n] = vertices[3*corners[c] + n];
+                    triangle.v2[n] = vertices[3*corners[c+1] + n];
+                }
+                float e1[3], e2[3];
+                for (int n=0; n<3; n++){
+                    e1[n] = triangle.v1[n] - triangle.v0[n];
+                    e2[n] = triangle.v2[n] - triangle.v0[n];
+                }
+                triangle.normal[0] = e1[1]*e2[2] - e1[2]*e2[1];
+                triangle.normal[1] = e1[2]*e2[0] - e1[0]*e2[2];
+                triangle.normal[2] = e1[0]*e2[1] - e1[1]*e2[0];
+                float length = sqrt(pow(triangle.normal[0], 2) + pow(triangle.normal[1], 2) + pow(triangle.normal[2], 2));
+                if (length == 0){
+                    continue; //degenerate face
+                }
+                for (int n=0; n<3; n++){
+                    triangle.normal[n] /= length;
+                }
+                triangles.push_back(triangle);
+            }
+        }
+    }
+    //-------------------------------------
+    
+    return triangles;
+}
+
+//Bounds of a triangle, grown by obstacle_thickness so a mass behind it still lands inside
+void triangle_bounds(Triangle &triangle, float box_min[3], float box_max[3]){
+    for (int n=0; n<3; n++){
+        box_min[n] = min(triangle.v0[n], min(triangle.v1[n], triangle.v2[n])) - obstacle_thickness;
+        box_max[n] = max(triangle.v0[n], max(triangle.v1[n], triangle.v2[n])) + obstacle_thickness;
+    }
+}
+
+float box_area(float box_min[3], float box_max[3]){
+    float x = box_max[0] - box_min[0];
+    float y = box_max[1] - box_min[1];
+    float z = box_max[2] - box_min[2];
+    return 2.0f*(x*y + y*z + z*x);
+}
+
+int build_bvh_node(Obstacle &obstacle, vector<int> &order, vector<float> &bounds, vector<float> &centroids, int first, int count, int depth){
+    int node_index = (int)obstacle.nodes.size();
+    obstacle.nodes.push_back(BVHNode());
+    
+    BVHNode node;
+    float centroid_min[3], centroid_max[3];
+    for (int n=0; n<3; n++){
+        node.box_min[n] = centroid_min[n] = INFINITY;
+        node.box_max[n] = centroid_max[n] = -INFINITY;
+    }
+    for (int i=first; i<first+count; i++){
+        int t = order[i];
+        for (int n=0; n<3; n++){
+            node.box_min[n] = min(node.box_min[n], bounds[6*t + n]);
+            node.box_max[n] = max(node.box_max[n], bounds[6*t + 3 + n]);
+            centroid_min[n] = min(centroid_min[n], centroids[3*t + n]);
+            centroid_max[n] = max(centroid_max[n], centroids[3*t + n]);
+        }
+    }
+    
+    //Find the cheapest binned SAH split over all three axes
+    //-------------------------------------
+    int best_axis = -1;
+    int best_split = 0;
+    float best_cost = count; //cost of leaving all triangles in one leaf
+    
+    for (int axis=0; axis<3 && count > bvh_leaf_size && depth < bvh_max_depth-1; axis++){
+        float extent = centroid_max[axis] - centroid_min[axis];
+        if (extent <= 0){
+            continue;
+        }
+        
+        int bin_count[bvh_bins] = {0};
+        float bin_min[bvh_bins][3], bin_max[bvh_bins][3];
+        for (int k=0; k<bvh_bins; k++){
+            for (int n=0; n<3; n++){
+                bin_min[k][n] = INFINITY;
+                bin_max[k][n] = -INFINITY;
+            }
+        }
+        for (int i=first; i<first+count; i++){
+            int t = order[i];
+            int k = min(bvh_bins-1, (int)(bvh_bins*(centroids[3*t + axis] - centroid_min[axis])/extent));
+            bin_count[k] += 1;
+            for (int n=0; n<3; n++){
+                bin_min[k][n] = min(bin_min[k][n], bounds[6*t + n]);
+                bin_max[k][n] = max(bin_max[k][n], bounds[6*t + 3 + n]);
+            }
+        }
+        
+        //sweep from the right to get the area of every right hand side, then from the left
+        float right_area[bvh_bins];
+        int right_count[bvh_bins];
+        float box_min[3] = {INFINITY, INFINITY, INFINITY};
+        float box_max[3] = {-INFINITY, -INFINITY, -INFINITY};
+        int total = 0;
+        for (int k=bvh_bins-1; k>0; k--){
+            total += bin_count[k];
+            for (int n=0; n<3; n++){
+                box_min[n] = min(box_min[n], bin_min[k][n]);
+                box_max[n] = max(box_max[n], bin_max[k][n]);
+            }
+            right_count[k] = total;
+            right_area[k] = total > 0 ? box_area(box_min, box_max) : 0;
+        }
+        
+        for (int n=0; n<3; n++){
+            box_min[n] = INFINITY;
+            box_max[n] = -INFINITY;
+        }
+        total = 0;
+        float parent_area = box_area(node.box_min, node.box_max);
+        for (int k=0; k<bvh_bins-1; k++){
+            total += bin_count[k];
+            for (int n=0; n<3; n++){
+                box_min[n] = min(box_min[n], bin_min[k][n]);
+                box_max[n] = max(box_max[n], bin_max[k][n]);
+            }
+            if (total == 0 || right_count[k+1] == 0){
+                continue;
+            }
+            float cost = 1.0f + (total*box_area(box_min, box_max) + right_count[k+1]*right_area[k+1])/parent_area;
+            if (cost < best_cost){
+                best_cost = cost;
+                best_axis = axis;
+                best_split = k+1;
+            }
+        }
+    }
+    //-------------------------------------
+    
+    if (best_axis < 0){
+        node.first = first;
+        node.count = count;
+        obstacle.nodes[node_index] = node;
+        return node_index;
+    }
+    
+    float extent = centroid_max[best_axis] - centroid_min[best_axis];
+    int* middle = partition(&order[first], &order[first] + count, [&](int t){
+        return min(bvh_bins-1, (int)(bvh_bins*(centroids[3*t + best_axis] - centroid_min[best_axis])/extent)) < best_split;
+    });
+    int left_count = (int)(middle - &order[first]);
+    
+    build_bvh_node(obstacle, order, bounds, centroids, first, left_count, depth+1);
+    node.first = build_bvh_node(obstacle, order, bounds, centroids, first + left_count, count - left_count, depth+1);
+    node.count = 0;
+    obstacle.nodes[node_index] = node;
+    return node_index;
+}
+
+void build_bvh(Obstacle &obstacle){
+    int num_triangles = (int)obstacle.triangles.size();
+    obstacle.nodes.clear();
+    if (num_triangles == 0){
+        return;
+    }
+    
+    vector<int> order(num_triangles);
+    vector<float> bounds(6*num_triangles);
+    vector<float> centroids(3*num_triangles);
+    for (int t=0; t<num_triangles; t++){
+        order[t] = t;
+        triangle_bounds(obstacle.triangles[t], &bounds[6*t], &bounds[6*t + 3]);
+        for (int n=0; n<3; n++){
+            centroids[3*t + n] = 0.5f*(bounds[6*t + n] + bounds[6*t + 3 + n]);
+        }
+    }
+    
+    obstacle.nodes.reserve(2*num_triangles);
+    build_bvh_node(obstacle, order, bounds, centroids, 0, num_triangles, 0);
+    
+    //store the triangles in leaf order so a leaf reads one contiguous block
+    vector<Triangle> sorted(num_triangles);
+    for (int i=0; i<num_triangles; i++){
+        sorted[i] = obstacle.triangles[order[i]];
+    }
+    obstacle.triangles = sorted;
+}
+
+//How far the point is pushed into the triangle, or 0 if it does not touch it
+float triangle_penetration(Triangle &triangle, vector<float> &position){
+    float p[3];
+    for (int n=0; n<3; n++){
+        p[n] = position[n] - triangle.v0[n];
+    }
+    float distance = p[0]*triangle.normal[0] + p[1]*triangle.normal[1] + p[2]*triangle.normal[2];
+    if (distance >= 0 || distance < -obstacle_thickness){
+        return 0;
+    }
+    
+    //barycentric test of the point projected onto the plane of the triangle
+    float e1[3], e2[3];
+    for (int n=0; n<3; n++){
+        e1[n] = triangle.v1[n] - triangle.v0[n];
+        e2[n] = triangle.v2[n] - triangle.v0[n];
+    }
+    float d11 = e1[0]*e1[0] + e1[1]*e1[1] + e1[2]*e1[2];
+    float d12 = e1[0]*e2[0] + e1[1]*e2[1] + e1[2]*e2[2];
+    float d22 = e2[0]*e2[0] + e2[1]*e2[1] + e2[2]*e2[2];
+    float dp1 = p[0]*e1[0] + p[1]*e1[1] + p[2]*e1[2];
+    float dp2 = p[0]*e2[0] + p[1]*e2[1] + p[2]*e2[2];
+    float denominator = d11*d22 - d12*d12;
+    float u = (d22*dp1 - d12*dp2)/denominator;
+    float v = (d11*dp2 - d12*dp1)/denominator;
+    if (u < -1e-4f || v < -1e-4f || u + v > 1.0001f){ //small tolerance so masses on a shared edge do not fall through
+        return 0;
+    }
+    return -distance;
+}
+
+void obstacle_contact(PointMass &mass, vector<Obstacle> &obstacles){
+    int hit_obstacle = -1;
+    int hit_triangle = -1;
+    float depth = 0;
+    
+    //Masses resting on an obstacle usually touch the same triangle as last step, which then wins ties
+    //-------------------------------------
+    if (mass.last_obstacle >= 0){
+        depth = triangle_penetration(obstacles[mass.last_obstacle].triangles[mass.last_triangle], mass.position);
+        if (depth > 0){
+            hit_obstacle = mass.last_obstacle;
+            hit_triangle = mass.last_triangle;
+        }
+    }
+    //-------------------------------------
+    
+    //Walk the BVH of every obstacle and keep the deepest contact, a mass can touch more than one
+    //-------------------------------------
+    for (int o=0; o<obstacles.size(); o++){
+        vector<BVHNode> &nodes = obstacles[o].nodes;
+        if (nodes.empty()){
+            continue;
+        }
+        int stack[bvh_max_depth];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0){
+            BVHNode &node = nodes[stack[--top]];
+            if (mass.position[0] < node.box_min[0] || mass.position[0] > node.box_max[0] ||
+                mass.position[1] < node.box_min[1] || mass.position[1] > node.box_max[1] ||
+                mass.position[2] < node.box_min[2] || mass.position[2] > node.box_max[2]){
+                continue;
+            }
+            if (node.count > 0){
+                for (int t=node.first; t<node.first+node.count; t++){
+                    float triangle_depth = triangle_penetration(obstacles[o].triangles[t], mass.position);
+                    if (triangle_depth > depth){
+                        depth = triangle_depth;
+                        hit_obstacle = o;
+                        hit_triangle = t;
+                    }
+                }
+            }
+            else{
+                stack[top++] = node.first;
+                stack[top++] = (int)(&node - &nodes[0]) + 1;
+            }
+        }
+    }
+    //-------------------------------------
+    
+    mass.last_obstacle = hit_obstacle;
+    mass.last_triangle = hit_triangle;
+    if (hit_obstacle < 0){
+        return;
+    }
+    
+    //spring and dashpot along the normal like the ground, only pushing
+    Triangle &triangle = obstacles[hit_obstacle].triangles[hit_triangle];
+    float normal_velocity = mass.velocity[0]*triangle.normal[0] + mass.velocity[1]*triangle.normal[1] + mass.velocity[2]*triangle.normal[2];
+    float damping = contact_damping*2.0f*sqrt(obstacle_stiffness*mass.mass);
+    float push = max(0.0f, depth*obstacle_stiffness - damping*normal_velocity);
+    for (int n=0; n<3; n++){
+        mass.forces[n] = mass.forces[n] + push*triangle.normal[n];
+    }
+}
+
+int find_root(vector<int> &parent, int i){
+    while (parent[i] != i){
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+void build_rigid_clusters(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<RigidCluster> &clusters){
+    
+    //Join the masses connected by stiff springs (union-find)
+    //-------------------------------------
+    vector<int> parent(masses.size());
+    for (int i=0; i<masses.size(); i++){
+        parent[i] = i;
+        masses[i].cluster = -1;
+    }
+    for (int i=0; i<springs.size(); i++){
+        springs[i].rigid = false;
+        if (springs[i].k >= rigid_stiffness){
+            parent[find_root(parent, springs[i].m0)] = find_root(parent, springs[i].m1);
+        }
+    }
+    
+    vector<vector<int>> groups(masses.size());
+    for (int i=0; i<masses.size(); i++){
+        groups[find_root(parent, i)].push_back(i);
+    }
+    //-------------------------------------
+    
+    //Every group of at least 3 masses that is not degenerate becomes a rigid cluster
+    //-------------------------------------
+    clusters.clear();
+    for (int r=0; r<groups.size(); r++){
+        if (groups[r].size() < 3){
+            continue;
+        }
+        RigidCluster cluster;
+        cluster.members = groups[r];
+        cluster.body = body_of_mass(bodies, groups[r][0]);
+        cluster.mass = 0;
+        cluster.position = glm::vec3(0.0f);
+        cluster.velocity = glm::vec3(0.0f);
+        for (int m : cluster.members){
+            float mass = masses[m].mass;
+            cluster.mass += mass;
+            cluster.position += mass*glm::vec3(masses[m].position[0], masses[m].position[1], masses[m].position[2]);
+            cluster.velocity += mass*glm::vec3(masses[m].velocity[0], masses[m].velocity[1], masses[m].velocity[2]);
+        }
+        cluster.position /= cluster.mass;
+        cluster.velocity /= cluster.mass;
+        
+        glm::mat3 inertia(0.0f);
+        cluster.angular_momentum = glm::vec3(0.0f);
+        for (int m : cluster.members){
+            float mass = masses[m].mass;
+            glm::vec3 r = glm::vec3(masses[m].position[0], masses[m].position[1], masses[m].position[2]) - cluster.position;
+            glm::vec3 v = glm::vec3(masses[m].velocity[0], masses[m].velocity[1], masses[m].velocity[2]);
+            cluster.offsets.push_back(r);
+            cluster.angular_momentum += mass*glm::cross(r, v);
+            inertia += mass*(glm::dot(r, r)*glm::mat3(1.0f) - glm::outerProduct(r, r));
+        }
+        if (fabs(glm::determinant(inertia)) < 1e-12f){
+            continue; //all masses on one line, leave them soft
+        }
+        cluster.inertia_inv = glm::inverse(inertia);
+        cluster.orientation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        
+        int index = (int)clusters.size();
+        for (int m : cluster.members){
+            masses[m].cluster = index;
+        }
+        clusters.push_back(cluster);
+    }
+    //-------------------------------------
+    
+    for (int i=0; i<springs.size(); i++){
+        int c = masses[springs[i].m0].cluster;
+        springs[i].rigid = c >= 0 && c == masses[springs[i].m1].cluster;
+    }
+}
+
+void update_rigid_clusters(vector<PointMass> &masses, vector<Body> &bodies, vector<RigidCluster> &clusters){
+    for (int c=0; c<clusters.size(); c++){
+        RigidCluster &cluster = clusters[c];
+        if (cluster.body >= 0 && bodies[cluster.body].asleep){
+            continue;
+        }
+        
+        //Total force and torque the soft springs, gravity and contacts put on the cluster
+        //-------------------------------------
+        glm::vec3 force(0.0f);
+        glm::vec3 torque(0.0f);
+        for (int m : cluster.members){
+            glm::vec3 f = glm::vec3(masses[m].forces[0], masses[m].forces[1], masses[m].forces[2]);
+            glm::vec3 r = glm::vec3(masses[m].position[0], masses[m].position[1], masses[m].position[2]) - cluster.position;
+            force += f;
+            torque += glm::cross(r, f);
+        }
+        //-------------------------------------
+        
+        //Same semi-implicit Euler step as update_pos_vel_acc, for 6 degrees of freedom
+        //-------------------------------------
+        glm::vec3 acceleration = force/cluster.mass;
+        cluster.velocity += acceleration*dt;
+        cluster.position += cluster.velocity*dt;
+        
+        cluster.angular_momentum += torque*dt;
+        glm::mat3 rotation = glm::mat3_cast(cluster.orientation);
+        glm::vec3 omega = rotation*cluster.inertia_inv*glm::transpose(rotation)*cluster.angular_momentum;
+        cluster.orientation = glm::normalize(cluster.orientation + 0.5f*dt*glm::quat(0.0f, omega)*cluster.orientation);
+        rotation = glm::mat3_cast(cluster.orientation);
+        omega = rotation*cluster.inertia_inv*glm::transpose(rotation)*cluster.angular_momentum;
+        //-------------------------------------
+        
+        for (int i=0; i<cluster.members.size(); i++){
+            int m = cluster.members[i];
+            glm::vec3 r = rotation*cluster.offsets[i];
+            glm::vec3 v = cluster.velocity + glm::cross(omega, r);
+            for (int n=0; n<3; n++){
+                masses[m].position[n] = cluster.position[n] + r[n];
+                masses[m].velocity[n] = v[n];
+                masses[m].acceleration[n] = acceleration[n];
+            }
+        }
+    }
+}
+
+float stable_dt(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies){
+    //Largest time step for which every spring that is still evaluated stays stable on its own
+    float smallest = INFINITY;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        for (int i=bodies[b_i].first_spring; i<bodies[b_i].first_spring + bodies[b_i].num_springs; i++){
+            if (springs[i].rigid){
+                continue;
+            }
+            float omega = sqrt(springs[i].k*(1.0f/masses[springs[i].m0].mass + 1.0f/masses[springs[i].m1].mass));
+            smallest = min(smallest, 2.0f/omega);
+        }
+    }
+    return smallest;
+}
+
+//Eigenvalues (ascending) and eigenvectors (columns of V) of the symmetric n x n matrix stored in V,
+//Householder tridiagonalization followed by the implicit QL method
+void symmetric_eigen(int n, vector<double> &V, vector<double> &d){
+    vector<double> e(n);
+    d.assign(n, 0.0);
+    auto v = [&](int i, int j) -> double& { return V[i*n + j]; };
+    
+    //Householder reduction to tridiagonal form
+    //-------------------------------------
+    for (int j=0; j<n; j++){
+        d[j] = v(n-1, j);
+    }
+    for (int i=n-1; i>0; i--){
+        double scale = 0.0;
+        double h = 0.0;
+        for (int k=0; k<i; k++){
+            scale += fabs(d[k]);
+        }
+        if (scale == 0.0){
+            e[i] = d[i-1];
+            for (int j=0; j<i; j++){
+                d[j] = v(i-1, j);
+                v(i, j) = 0.0;
+                v(j, i) = 0.0;
+            }
+        }
+        else{
+            for (int k=0; k<i; k++){
+                d[k] /= scale;
+                h += d[k]*d[k];
+            }
+            double f = d[i-1];
+            double g = sqrt(h);
+            if (f > 0){
+                g = -g;
+            }
+            e[i] = scale*g;
+            h = h - f*g;
+            d[i-1] = f - g;
+            for (int j=0; j<i; j++){
+                e[j] = 0.0;
+            }
+            for (int j=0; j<i; j++){
+                f = d[j];
+                v(j, i) = f;
+                g = e[j] + v(j, j)*f;
+                for (int k=j+1; k<=i-1; k++){
+                    g += v(k, j)*d[k];
+                    e[k] += v(k, j)*f;
+                }
+                e[j] = g;
+            }
+            f = 0.0;
+            for (int j=0; j<i; j++){
+                e[j] /= h;
+                f += e[j]*d[j];
+            }
+            double hh = f/(h + h);
+            for (int j=0; j<i; j++){
+                e[j] -= hh*d[j];
+            }
+            for (int j=0; j<i; j++){
+                f = d[j];
+                g = e[j];
+                for (int k=j; k<=i-1; k++){
+                    v(k, j) -= (f*e[k] + g*d[k]);
+                }
+                d[j] = v(i-1, j);
+                v(i, j) = 0.0;
+            }
+        }
+        d[i] = h;
+    }
+    for (int i=0; i<n-1; i++){
+        v(n-1, i) = v(i, i);
+        v(i, i) = 1.0;
+        double h = d[i+1];
+        if (h != 0.0){
+            for (int k=0; k<=i; k++){
+                d[k] = v(k, i+1)/h;
+            }
+            for (int j=0; j<=i; j++){
+                double g = 0.0;
+                for (int k=0; k<=i; k++){
+                    g += v(k, i+1)*v(k, j);
+                }
+                for (int k=0; k<=i; k++){
+                    v(k, j) -= g*d[k];
+                }
+            }
+        }
+        for (int k=0; k<=i; k++){
+            v(k, i+1) = 0.0;
+        }
+    }
+    for (int j=0; j<n; j++){
+        d[j] = v(n-1, j);
+        v(n-1, j) = 0.0;
+    }
+    v(n-1, n-1) = 1.0;
+    e[0] = 0.0;
+    //-------------------------------------
+    
+    //Implicit QL iterations on the tridiagonal matrix
+    //-------------------------------------
+    for (int i=1; i<n; i++){
+        e[i-1] = e[i];
+    }
+    e[n-1] = 0.0;
+    double f = 0.0;
+    double tst1 = 0.0;
+    double eps = pow(2.0, -52.0);
+    for (int l=0; l<n; l++){
+        tst1 = max(tst1, fabs(d[l]) + fabs(e[l]));
+        int m = l;
+        while (m < n-1 && fabs(e[m]) > eps*tst1){
+            m++;
+        }
+        if (m > l){
+            do{
+                double g = d[l];
+                double p = (d[l+1] - g)/(2.0*e[l]);
+                double r = hypot(p, 1.0);
+                if (p < 0){
+                    r = -r;
+                }
+                d[l] = e[l]/(p + r);
+                d[l+1] = e[l]*(p + r);
+                double dl1 = d[l+1];
+                double h = g - d[l];
+                for (int i=l+2; i<n; i++){
+                    d[i] -= h;
+                }
+                f = f + h;
+                
+                p = d[m];
+                double c = 1.0, c2 = c, c3 = c;
+                double el1 = e[l+1];
+                double s = 0.0, s2 = 0.0;
+                for (int i=m-1; i>=l; i--){
+                    c3 = c2;
+                    c2 = c;
+                    s2 = s;
+                    g = c*e[i];
+                    h = c*p;
+                    r = hypot(p, e[i]);
+                    e[i+1] = s*r;
+                    s = e[i]/r;
+                    c = p/r;
+                    p = c*d[i] - s*g;
+                    d[i+1] = h + s*(c*g + s*d[i]);
+                    for (int k=0; k<n; k++){
+                        h = v(k, i+1);
+                        v(k, i+1) = s*v(k, i) + c*h;
+                        v(k, i) = c*v(k, i) - s*h;
+                    }
+                }
+                p = -s*s2*c3*el1*e[l]/dl1;
+                e[l] = s*p;
+                d[l] = c*p;
+            } while (fabs(e[l]) > eps*tst1);
+        }
+        d[l] = d[l] + f;
+        e[l] = 0.0;
+    }
+    //-------------------------------------
+    
+    //Sort ascending
+    for (int i=0; i<n-1; i++){
+        int k = i;
+        double p = d[i];
+        for (int j=i+1; j<n; j++){
+            if (d[j] < p){
+                k = j;
+                p = d[j];
+            }
+        }
+        if (k != i){
+            d[k] = d[i];
+            d[i] = p;
+            for (int j=0; j<n; j++){
+                swap(v(j, i), v(j, k));
+            }
+        }
+    }
+}
+
+//out = K(x)*u, with K(x) the tangent stiffness of the spring network at positions x
+void spring_stiffness_product(vector<Spring> &springs, vector<double> &x, vector<double> &u, vector<double> &out){
+    fill(out.begin(), out.end(), 0.0);
+    for (int i=0; i<springs.size(); i++){
+        int p0 = springs[i].m0;
+        int p1 = springs[i].m1;
+        double d[3], du[3];
+        for (int n=0; n<3; n++){
+            d[n] = x[3*p1 + n] - x[3*p0 + n];
+            du[n] = u[3*p1 + n] - u[3*p0 + n];
+        }
+        double L = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        for (int n=0; n<3; n++){
+            d[n] /= L;
+        }
+        double along = d[0]*du[0] + d[1]*du[1] + d[2]*du[2];
+        double stretch = 1.0 - springs[i].L0/L;
+        for (int n=0; n<3; n++){
+            double f = springs[i].k*(along*d[n] + stretch*(du[n] - along*d[n]));
+            out[3*p1 + n] += f;
+            out[3*p0 + n] -= f;
+        }
+    }
+}
+
+void build_modal_model(vector<PointMass> &masses, vector<Spring> &springs, ModalModel &model){
+    int num_masses = (int)masses.size();
+    int N = 3*num_masses;
+    int K = min(modal_modes, N);
+    model.num_dofs = N;
+    model.num_modes = K;
+    
+    vector<double> rest(N);
+    vector<double> inv_sqrt_mass(N);
+    for (int i=0; i<num_masses; i++){
+        for (int n=0; n<3; n++){
+            rest[3*i + n] = masses[i].position[n];
+            inv_sqrt_mass[3*i + n] = 1.0/sqrt(masses[i].mass);
+        }
+    }
+    model.rest.assign(rest.begin(), rest.end());
+    
+    //Mass-scaled stiffness M^-1/2 K M^-1/2 at rest, and its eigen decomposition
+    //-------------------------------------
+    vector<double> A(N*N, 0.0);
+    vector<double> column(N, 0.0), product(N);
+    for (int j=0; j<N; j++){
+        column[j] = inv_sqrt_mass[j];
+        spring_stiffness_product(springs, rest, column, product);
+        column[j] = 0.0;
+        for (int i=0; i<N; i++){
+            A[i*N + j] = inv_sqrt_mass[i]*product[i];
+        }
+    }
+    vector<double> lambda;
+    symmetric_eigen(N, A, lambda);
+    
+    double largest = max(fabs(lambda[N-1]), 1e-12);
+    model.num_rigid = 0;
+    while (model.num_rigid < N && lambda[model.num_rigid] < 1e-6*largest){
+        model.num_rigid += 1;
+    }
+    
+    model.modes.assign(K*N, 0.0f);
+    model.frequencies_2.assign(K, 0.0f);
+    for (int k=0; k<K; k++){
+        model.frequencies_2[k] = k < model.num_rigid ? 0.0f : (float)lambda[k];
+        for (int i=0; i<N; i++){
+            model.modes[k*N + i] = (float)(inv_sqrt_mass[i]*A[i*N + k]);
+        }
+    }
+    //-------------------------------------
+    
+    //Modal derivatives Psi_ij = -K^+ (dK/dphi_i) phi_j of the elastic modes, by central differences
+    //-------------------------------------
+    int elastic = max(0, K - model.num_rigid);
+    model.derivatives.assign(elastic*(elastic + 1)/2*N, 0.0f);
+    float shortest = INFINITY;
+    for (int s=0; s<springs.size(); s++){
+        shortest = min(shortest, springs[s].L0);
+    }
+    
+    vector<double> phi_i(N), phi_j(N), x_plus(N), x_minus(N), k_plus(N), k_minus(N), rhs(N);
+    int pair = 0;
+    for (int i=model.num_rigid; i<K; i++){
+        double largest_component = 0;
+        for (int n=0; n<N; n++){
+            phi_i[n] = model.modes[i*N + n];
+            largest_component = max(largest_component, fabs(phi_i[n]));
+        }
+        double h = 1e-3*shortest/largest_component;
+        for (int n=0; n<N; n++){
+            x_plus[n] = rest[n] + h*phi_i[n];
+            x_minus[n] = rest[n] - h*phi_i[n];
+        }
+        for (int j=i; j<K; j++, pair++){
+            for (int n=0; n<N; n++){
+                phi_j[n] = model.modes[j*N + n];
+            }
+            spring_stiffness_product(springs, x_plus, phi_j, k_plus);
+            spring_stiffness_product(springs, x_minus, phi_j, k_minus);
+            for (int n=0; n<N; n++){
+                rhs[n] = -inv_sqrt_mass[n]*(k_plus[n] - k_minus[n])/(2.0*h);
+            }
+            //pseudo-inverse through the elastic eigenpairs, rigid modes are left out
+            for (int e=model.num_rigid; e<N; e++){
+                double c = 0;
+                for (int n=0; n<N; n++){
+                    c += A[n*N + e]*rhs[n];
+                }
+                c /= lambda[e];
+                for (int n=0; n<N; n++){
+                    model.derivatives[pair*N + n] += (float)(c*A[n*N + e]*inv_sqrt_mass[n]);
+                }
+            }
+        }
+    }
+    //-------------------------------------
+    
+    //Gravity and breathing projected onto the modes
+    //-------------------------------------
+    model.gravity.assign(K, 0.0f);
+    model.actuation.assign(K*breathing_springs.size(), 0.0f);
+    for (int k=0; k<K; k++){
+        for (int i=0; i<num_masses; i++){
+            model.gravity[k] += model.modes[k*N + 3*i + 2]*masses[i].mass*g;
+        }
+        for (int a=0; a<breathing_springs.size(); a++){
+            if (breathing_springs[a] < 0){
+                continue;
+            }
+            Spring &spring = springs[breathing_springs[a]];
+            for (int n=0; n<3; n++){
+                float direction = (masses[spring.m0].position[n] - masses[spring.m1].position[n])/spring.L0;
+                model.actuation[a*K + k] += spring.k*direction*(model.modes[k*N + 3*spring.m0 + n] - model.modes[k*N + 3*spring.m1 + n]);
+            }
+        }
+    }
+    //-------------------------------------
+    
+    //Cubature masses picked by farthest point sampling, weighted by how many masses are closest to them
+    //-------------------------------------
+    int num_cubature = min(modal_cubature, num_masses);
+    model.cubature.assign(1, 0);
+    vector<float> distance(num_masses, INFINITY);
+    vector<int> closest(num_masses, 0);
+    for (int c=0; c<num_cubature; c++){
+        int latest = model.cubature[c];
+        int farthest = 0;
+        for (int i=0; i<num_masses; i++){
+            float d = 0;
+            for (int n=0; n<3; n++){
+                d += pow(masses[i].position[n] - masses[latest].position[n], 2);
+            }
+            if (d < distance[i]){
+                distance[i] = d;
+                closest[i] = c;
+            }
+            if (distance[i] > distance[farthest]){
+                farthest = i;
+            }
+        }
+        if (c+1 < num_cubature){
+            model.cubature.push_back(farthest);
+        }
+    }
+    model.cubature_weights.assign(num_cubature, 0.0f);
+    model.cubature_masses.assign(num_cubature, 0.0f);
+    for (int i=0; i<num_masses; i++){
+        model.cubature_weights[closest[i]] += 1.0f;
+        model.cubature_masses[closest[i]] += masses[i].mass;
+    }
+    //-------------------------------------
+    
+    //Start from the current velocities, the masses are assumed to be at rest length
+    model.q.assign(K, 0.0f);
+    model.q_dot.assign(K, 0.0f);
+    for (int k=0; k<K; k++){
+        for (int i=0; i<num_masses; i++){
+            for (int n=0; n<3; n++){
+                model.q_dot[k] += model.modes[k*N + 3*i + n]*masses[i].mass*masses[i].velocity[n];
+            }
+        }
+    }
+}
+
+//Displacement of one degree of freedom from the modal coordinates, including the modal derivatives
+float modal_displacement(ModalModel &model, int dof){
+    int N = model.num_dofs;
+    int K = model.num_modes;
+    float u = 0;
+    for (int k=0; k<K; k++){
+        u += model.modes[k*N + dof]*model.q[k];
+    }
+    int pair = 0;
+    for (int i=model.num_rigid; i<K; i++){
+        for (int j=i; j<K; j++, pair++){
+            float weight = i == j ? 0.5f : 1.0f;
+            u += weight*model.derivatives[pair*N + dof]*model.q[i]*model.q[j];
+        }
+    }
+    return u;
+}
+
+//One step of the K modal coordinates. The cubature contact evaluates the displacement of C masses at O(K^2) each,
+//so a step costs O(C K^2), independent of the number of masses
+void update_modal(ModalModel &model, vector<Spring> &springs){
+    int K = model.num_modes;
+    model.force = model.gravity; //same size every step, so the scratch keeps its storage
+    vector<float> &force = model.force;
+    
+    for (int a=0; a<breathing_springs.size(); a++){
+        if (breathing_springs[a] < 0){
+            continue;
+        }
+        Spring &spring = springs[breathing_springs[a]];
+        float change = spring.L0 - spring.original_L0;
+        for (int k=0; k<K; k++){
+            force[k] += change*model.actuation[a*K + k];
+        }
+    }
+    
+    //Ground contact on the cubature masses only
+    //-------------------------------------
+    for (int c=0; c<model.cubature.size(); c++){
+        int dof = 3*model.cubature[c] + 2;
+        float z = model.rest[dof] + modal_displacement(model, dof);
+        if (z < 0){
+            //Same dashpot as the ground in update_forces, on the linear velocity of the cubature mass
+            float velocity = 0;
+            for (int k=0; k<K; k++){
+                velocity += model.modes[k*model.num_dofs + dof]*model.q_dot[k];
+            }
+            float stiffness = ground_stiffness*model.cubature_weights[c];
+            float damping = contact_damping*2.0f*sqrt(stiffness*model.cubature_masses[c]);
+            float contact = max(0.0f, -z*stiffness - damping*velocity);
+            for (int k=0; k<K; k++){
+                force[k] += contact*model.modes[k*model.num_dofs + dof];
+            }
+        }
+    }
+    //-------------------------------------
+    
+    //spring_damping becomes the damping ratio of every elastic mode, damped scales the velocities like update_pos_vel_acc
+    for (int k=0; k<K; k++){
+        float acceleration = force[k] - model.frequencies_2[k]*model.q[k] - 2.0f*spring_damping*sqrt(model.frequencies_2[k])*model.q_dot[k];
+        model.q_dot[k] = model.q_dot[k] + acceleration*dt;
+        if (damped){
+            model.q_dot[k] *= b;
+        }
+        model.q[k] = model.q[k] + model.q_dot[k]*dt;
+    }
+}
+
+//Positions and velocities of the masses first to last-1 from the modal coordinates
+void modal_positions(ModalModel &model, vector<PointMass> &masses, int first, int last){
+    int N = model.num_dofs;
+    int K = model.num_modes;
+    for (int i=first; i<last; i++){
+        for (int n=0; n<3; n++){
+            int dof = 3*i + n;
+            float velocity = 0;
+            for (int k=0; k<K; k++){
+                velocity += model.modes[k*N + dof]*model.q_dot[k];
+            }
+            int pair = 0;
+            for (int a=model.num_rigid; a<K; a++){
+                for (int b=a; b<K; b++, pair++){
+                    float weight = a == b ? 0.5f : 1.0f;
+                    velocity += weight*model.derivatives[pair*N + dof]*(model.q_dot[a]*model.q[b] + model.q[a]*model.q_dot[b]);
+                }
+            }
+            masses[i].position[n] = model.rest[dof] + modal_displacement(model, dof);
+            masses[i].velocity[n] = velocity;
+        }
+    }
+}
+
+//Elastic energy of the modes, the modes are mass-orthonormal so every one stores w^2 q^2 / 2
+float modal_energy(ModalModel &model){
+    float energy = 0;
+    for (int k=model.num_rigid; k<model.num_modes; k++){
+        energy += 0.5f*model.frequencies_2[k]*model.q[k]*model.q[k];
+    }
+    return energy;
+}
+
+void sparse_multiply(SparseMatrix &a, vector<float> &x, vector<float> &y){
+    for (int i=0; i<a.rows; i++){
+        float sum = 0;
+        for (int p=a.row_start[i]; p<a.row_start[i+1]; p++){
+            sum += a.value[p]*x[a.column[p]];
+        }
+        y[i] = sum;
+    }
+}
+
+SparseMatrix sparse_transpose(SparseMatrix &a){
+    SparseMatrix t;
+    t.rows = a.cols;
+    t.cols = a.rows;
+    t.row_start.assign(t.rows + 1, 0);
+    for (int p=0; p<a.column.size(); p++){
+        t.row_start[a.column[p] + 1] += 1;
+    }
+    for (int i=0; i<t.rows; i++){
+        t.row_start[i+1] += t.row_start[i];
+    }
+    t.column.resize(a.column.size());
+    t.value.resize(a.value.size());
+    vector<int> next(t.row_start.begin(), t.row_start.end() - 1);
+    for (int i=0; i<a.rows; i++){
+        for (int p=a.row_start[i]; p<a.row_start[i+1]; p++){
+            int q = next[a.column[p]]++;
+            t.column[q] = i;
+            t.value[q] = a.value[p];
+        }
+    }
+    return t;
+}
+
+//c = a*b (Gustavson). With keep_pattern the sparsity of c is reused and only the values are recomputed
+void sparse_product(SparseMatrix &a, SparseMatrix &b, SparseMatrix &c, bool keep_pattern){
+    vector<int> marker(b.cols, -1);
+    if (!keep_pattern){
+        c.rows = a.rows;
+        c.cols = b.cols;
+        c.row_start.assign(a.rows + 1, 0);
+        c.column.clear();
+        for (int i=0; i<a.rows; i++){
+            for (int p=a.row_start[i]; p<a.row_start[i+1]; p++){
+                int k = a.column[p];
+                for (int q=b.row_start[k]; q<b.row_start[k+1]; q++){
+                    if (marker[b.column[q]] != i){
+                        marker[b.column[q]] = i;
+                        c.column.push_back(b.column[q]);
+                    }
+                }
+            }
+            c.row_start[i+1] = (int)c.column.size();
+        }
+        c.value.resize(c.column.size());
+        fill(marker.begin(), marker.end(), -1);
+    }
+    for (int i=0; i<a.rows; i++){
+        for (int p=c.row_start[i]; p<c.row_start[i+1]; p++){
+            marker[c.column[p]] = p;
+            c.value[p] = 0;
+        }
+        for (int p=a.row_start[i]; p<a.row_start[i+1]; p++){
+            int k = a.column[p];
+            for (int q=b.row_start[k]; q<b.row_start[k+1]; q++){
+                c.value[marker[b.column[q]]] += a.value[p]*b.value[q];
+            }
+        }
+    }
+}
+
+void build_multigrid(vector<PointMass> &masses, vector<Spring> &springs, Multigrid &mg){
+    int num_masses = (int)masses.size();
+    
+    //Sparsity of the full system, one 3x3 block per mass and per spring direction
+    //-------------------------------------
+    vector<vector<int>> neighbors(num_masses);
+    for (int i=0; i<num_masses; i++){
+        neighbors[i].push_back(i);
+    }
+    for (int s=0; s<springs.size(); s++){
+        neighbors[springs[s].m0].push_back(springs[s].m1);
+        neighbors[springs[s].m1].push_back(springs[s].m0);
+    }
+    SparseMatrix A;
+    A.rows = A.cols = 3*num_masses;
+    A.row_start.assign(A.rows + 1, 0);
+    for (int i=0; i<num_masses; i++){
+        sort(neighbors[i].begin(), neighbors[i].end());
+        neighbors[i].erase(unique(neighbors[i].begin(), neighbors[i].end()), neighbors[i].end());
+        for (int r=0; r<3; r++){
+            for (int j : neighbors[i]){
+                for (int c=0; c<3; c++){
+                    A.column.push_back(3*j + c);
+                }
+            }
+            A.row_start[3*i + r + 1] = (int)A.column.size();
+        }
+    }
+    A.value.assign(A.column.size(), 0.0f);
+    
+    //offset of the block (i, j): row 3i starts it, rows 3i+1 and 3i+2 follow one row length apart
+    auto block = [&](int i, int j){
+        int position = (int)(lower_bound(neighbors[i].begin(), neighbors[i].end(), j) - neighbors[i].begin());
+        return A.row_start[3*i] + 3*position;
+    };
+    mg.diagonal_blocks.resize(num_masses);
+    for (int i=0; i<num_masses; i++){
+        mg.diagonal_blocks[i] = block(i, i);
+    }
+    mg.spring_blocks.resize(4*springs.size());
+    for (int s=0; s<springs.size(); s++){
+        mg.spring_blocks[4*s + 0] = block(springs[s].m0, springs[s].m0);
+        mg.spring_blocks[4*s + 1] = block(springs[s].m0, springs[s].m1);
+        mg.spring_blocks[4*s + 2] = block(springs[s].m1, springs[s].m0);
+        mg.spring_blocks[4*s + 3] = block(springs[s].m1, springs[s].m1);
+    }
+    mg.A = {A};
+    mg.P.clear();
+    mg.R.clear();
+    mg.AP.clear();
+    //-------------------------------------
+    
+    //Place the masses on a grid with the shortest spring as spacing
+    //-------------------------------------
+    float spacing = INFINITY;
+    for (int s=0; s<springs.size(); s++){
+        spacing = min(spacing, springs[s].L0);
+    }
+    float origin[3] = {INFINITY, INFINITY, INFINITY};
+    for (int i=0; i<num_masses; i++){
+        for (int n=0; n<3; n++){
+            origin[n] = min(origin[n], masses[i].position[n]);
+        }
+    }
+    vector<int> coordinates(3*num_masses);
+    int dims[3] = {1, 1, 1};
+    mg.lattice = springs.size() > 0;
+    for (int i=0; i<num_masses && mg.lattice; i++){
+        for (int n=0; n<3; n++){
+            float cell = (masses[i].position[n] - origin[n])/spacing;
+            coordinates[3*i + n] = (int)lround(cell);
+            if (fabs(cell - coordinates[3*i + n]) > 0.1f){
+                mg.lattice = false; //not a cube lattice
+            }
+            dims[n] = max(dims[n], coordinates[3*i + n] + 1);
+        }
+    }
+    vector<int> node_of_cell;
+    if (mg.lattice){
+        node_of_cell.assign(dims[0]*dims[1]*dims[2], -1);
+        for (int i=0; i<num_masses; i++){
+            int cell = (coordinates[3*i + 2]*dims[1] + coordinates[3*i + 1])*dims[0] + coordinates[3*i];
+            if (node_of_cell[cell] >= 0){
+                mg.lattice = false; //two masses on one lattice point
+            }
+            node_of_cell[cell] = i;
+        }
+    }
+    //-------------------------------------
+    
+    //Coarsen by 2 per axis until the problem is small, P interpolates trilinearly
+    //-------------------------------------
+    while (mg.lattice && mg.A.back().rows > multigrid_coarsest){
+        int coarse_dims[3];
+        for (int n=0; n<3; n++){
+            coarse_dims[n] = dims[n]/2 + 1;
+        }
+        if (coarse_dims[0]*coarse_dims[1]*coarse_dims[2] >= dims[0]*dims[1]*dims[2]){
+            break;
+        }
+        vector<int> coarse_node(coarse_dims[0]*coarse_dims[1]*coarse_dims[2], -1);
+        int num_coarse = 0;
+        
+        SparseMatrix P;
+        P.rows = mg.A.back().rows;
+        P.row_start.assign(P.rows + 1, 0);
+        vector<int> fine_cell(P.rows/3);
+        for (int cell=0; cell<node_of_cell.size(); cell++){
+            if (node_of_cell[cell] >= 0){
+                fine_cell[node_of_cell[cell]] = cell;
+            }
+        }
+        vector<int> node_columns;
+        vector<float> node_weights;
+        for (int node=0; node<P.rows/3; node++){
+            int cell = fine_cell[node];
+            int index[3] = {cell % dims[0], (cell/dims[0]) % dims[1], cell/(dims[0]*dims[1])};
+            node_columns.clear();
+            node_weights.clear();
+            for (int corner=0; corner<8; corner++){
+                int coarse[3];
+                float weight = 1.0f;
+                bool used = true;
+                for (int n=0; n<3; n++){
+                    int side = (corner >> n) & 1;
+                    if (index[n] % 2 == 0){
+                        coarse[n] = index[n]/2;
+                        used = used && side == 0;
+                    }
+                    else{
+                        coarse[n] = (index[n] + (side ? 1 : -1))/2;
+                        weight *= 0.5f;
+                    }
+                }
+                if (!used){
+                    continue;
+                }
+                int c = (coarse[2]*coarse_dims[1] + coarse[1])*coarse_dims[0] + coarse[0];
+                if (coarse_node[c] < 0){
+                    coarse_node[c] = num_coarse++;
+                }
+                node_columns.push_back(coarse_node[c]);
+                node_weights.push_back(weight);
+            }
+            for (int r=0; r<3; r++){
+                for (int k=0; k<node_columns.size(); k++){
+                    P.column.push_back(3*node_columns[k] + r);
+                    P.value.push_back(node_weights[k]);
+                }
+                P.row_start[3*node + r + 1] = (int)P.column.size();
+            }
+        }
+        P.cols = 3*num_coarse;
+        
+        SparseMatrix R = sparse_transpose(P);
+        SparseMatrix AP, coarse_A;
+        sparse_product(mg.A.back(), P, AP, false);
+        sparse_product(R, AP, coarse_A, false);
+        mg.P.push_back(P);
+        mg.R.push_back(R);
+        mg.AP.push_back(AP);
+        mg.A.push_back(coarse_A);
+        
+        //the coarse grid becomes the fine grid of the next level
+        node_of_cell.assign(coarse_node.size(), -1);
+        for (int c=0; c<coarse_node.size(); c++){
+            node_of_cell[c] = coarse_node[c];
+        }
+        for (int n=0; n<3; n++){
+            dims[n] = coarse_dims[n];
+        }
+    }
+    //-------------------------------------
+    
+    int levels = (int)mg.A.size();
+    mg.diagonal_inv.resize(levels);
+    mg.x.resize(levels);
+    mg.b.resize(levels);
+    mg.r.resize(levels);
+    for (int l=0; l<levels; l++){
+        mg.diagonal_inv[l].assign(mg.A[l].rows, 0.0f);
+        mg.x[l].assign(mg.A[l].rows, 0.0f);
+        mg.b[l].assign(mg.A[l].rows, 0.0f);
+        mg.r[l].assign(mg.A[l].rows, 0.0f);
+    }
+    mg.rhs.assign(mg.A[0].rows, 0.0f);
+    mg.v.assign(mg.A[0].rows, 0.0f);
+    mg.p.assign(mg.A[0].rows, 0.0f);
+    mg.Ap.assign(mg.A[0].rows, 0.0f);
+}
+
+void jacobi_smooth(SparseMatrix &A, vector<float> &diagonal_inv, vector<float> &b, vector<float> &x, vector<float> &r, int sweeps){
+    for (int sweep=0; sweep<sweeps; sweep++){
+        sparse_multiply(A, x, r);
+        for (int i=0; i<A.rows; i++){
+            x[i] += 0.6667f*diagonal_inv[i]*(b[i] - r[i]);
+        }
+    }
+}
+
+//One V-cycle on level l for A[l] x[l] = b[l], starting from x[l] = 0
+void multigrid_cycle(Multigrid &mg, int l){
+    fill(mg.x[l].begin(), mg.x[l].end(), 0.0f);
+    if (l == mg.A.size() - 1){
+        jacobi_smooth(mg.A[l], mg.diagonal_inv[l], mg.b[l], mg.x[l], mg.r[l], 8*multigrid_smoothing);
+        return;
+    }
+    jacobi_smooth(mg.A[l], mg.diagonal_inv[l], mg.b[l], mg.x[l], mg.r[l], multigrid_smoothing);
+    
+    sparse_multiply(mg.A[l], mg.x[l], mg.r[l]);
+    for (int i=0; i<mg.A[l].rows; i++){
+        mg.r[l][i] = mg.b[l][i] - mg.r[l][i];
+    }
+    sparse_multiply(mg.R[l], mg.r[l], mg.b[l+1]);
+    multigrid_cycle(mg, l+1);
+    sparse_multiply(mg.P[l], mg.x[l+1], mg.r[l]);
+    for (int i=0; i<mg.A[l].rows; i++){
+        mg.x[l][i] += mg.r[l][i];
+    }
+    
+    jacobi_smooth(mg.A[l], mg.diagonal_inv[l], mg.b[l], mg.x[l], mg.r[l], multigrid_smoothing);
+}
+
+//Preconditioned conjugate gradients on A[0] x = b, x holds the initial guess. The residual lives in mg.b[0] and the
+//preconditioned residual in mg.x[0], where the V-cycle reads and writes them, so a step allocates and copies nothing
+int multigrid_solve(Multigrid &mg, vector<float> &b, vector<float> &x){
+    SparseMatrix &A = mg.A[0];
+    int n = A.rows;
+    vector<float> &r = mg.b[0];
+    vector<float> &z = mg.x[0];
+    vector<float> &p = mg.p;
+    vector<float> &Ap = mg.Ap;
+    
+    sparse_multiply(A, x, Ap);
+    double b_norm = 0;
+    for (int i=0; i<n; i++){
+        r[i] = b[i] - Ap[i];
+        b_norm += (double)b[i]*b[i];
+    }
+    b_norm = max(sqrt(b_norm), 1e-20);
+    
+    auto precondition = [&](){
+        if (mg.lattice){
+            multigrid_cycle(mg, 0); //only writes the coarser levels of b, so r survives
+        }
+        else{
+            for (int i=0; i<n; i++){
+                z[i] = mg.diagonal_inv[0][i]*r[i];
+            }
+        }
+    };
+    
+    precondition();
+    p = z;
+    double rz = 0;
+    for (int i=0; i<n; i++){
+        rz += (double)r[i]*z[i];
+    }
+    
+    int iteration = 0;
+    for (; iteration<cg_iterations; iteration++){
+        double r_norm = 0;
+        for (int i=0; i<n; i++){
+            r_norm += (double)r[i]*r[i];
+        }
+        if (sqrt(r_norm) < cg_tolerance*b_norm){
+            break;
+        }
+        sparse_multiply(A, p, Ap);
+        double pAp = 0;
+        for (int i=0; i<n; i++){
+            pAp += (double)p[i]*Ap[i];
+        }
+        float alpha = (float)(rz/pAp);
+        for (int i=0; i<n; i++){
+            x[i] += alpha*p[i];
+            r[i] -= alpha*Ap[i];
+        }
+        precondition();
+        double rz_new = 0;
+        for (int i=0; i<n; i++){
+            rz_new += (double)r[i]*z[i];
+        }
+        float beta = (float)(rz_new/rz);
+        rz = rz_new;
+        for (int i=0; i<n; i++){
+            p[i] = z[i] + beta*p[i];
+        }
+    }
+    return iteration;
+}
+
+void update_implicit(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, Multigrid &mg){
+    //Linearized backward Euler: (M + dt^2 K) v_new = M v + dt f, with the forces from update_forces
+    //-------------------------------------
+    SparseMatrix &A = mg.A[0];
+    fill(A.value.begin(), A.value.end(), 0.0f);
+    
+    //Slots in the gaps between bodies get identity rows, so they solve to zero velocity and stay put
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        Body &body = bodies[b_i];
+        for (int i=body.first_mass; i<next_mass_start(masses, bodies, b_i); i++){
+            bool live = i < body.first_mass + body.num_masses;
+            int row = A.row_start[3*i + 1] - A.row_start[3*i]; //distance between the rows of a block
+            int d = mg.diagonal_blocks[i];
+            for (int n=0; n<3; n++){
+                A.value[d + n*row + n] += live ? masses[i].mass : 1.0f;
+            }
+            if (live && masses[i].position[2] < 0){
+                A.value[d + 2*row + 2] += dt*dt*ground_stiffness; //ground contact, same stiffness as update_forces
+            }
+        }
+    }
+    for (int i=masses.size(); i<A.rows/3; i++){
+        int row = A.row_start[3*i + 1] - A.row_start[3*i];
+        for (int n=0; n<3; n++){
+            A.value[mg.diagonal_blocks[i] + n*row + n] += 1.0f; //slots freed off the end since build_multigrid
+        }
+    }
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        for (int s=bodies[b_i].first_spring; s<bodies[b_i].first_spring + bodies[b_i].num_springs; s++){
+            if (springs[s].rigid){
+                continue;
+            }
+            int p0 = springs[s].m0;
+            int p1 = springs[s].m1;
+            float d[3];
+            float L = 0;
+            for (int n=0; n<3; n++){
+                d[n] = masses[p1].position[n] - masses[p0].position[n];
+                L += d[n]*d[n];
+            }
+            L = sqrt(L);
+            for (int n=0; n<3; n++){
+                d[n] /= L;
+            }
+            //tangent stiffness, the compressive part of the geometric term is dropped so A stays positive definite
+            float stretch = max(0.0f, 1.0f - springs[s].L0/L);
+            int row0 = A.row_start[3*p0 + 1] - A.row_start[3*p0];
+            int row1 = A.row_start[3*p1 + 1] - A.row_start[3*p1];
+            for (int a=0; a<3; a++){
+                for (int c=0; c<3; c++){
+                    float k = dt*dt*springs[s].k*(d[a]*d[c] + stretch*((a == c ? 1.0f : 0.0f) - d[a]*d[c]));
+                    A.value[mg.spring_blocks[4*s + 0] + a*row0 + c] += k;
+                    A.value[mg.spring_blocks[4*s + 1] + a*row0 + c] -= k;
+                    A.value[mg.spring_blocks[4*s + 2] + a*row1 + c] -= k;
+                    A.value[mg.spring_blocks[4*s + 3] + a*row1 + c] += k;
+                }
+            }
+        }
+    }
+    //-------------------------------------
+    
+    //Galerkin coarse operators on the fixed sparsity, then solve
+    //-------------------------------------
+    for (int l=0; l+1<mg.A.size(); l++){
+        sparse_product(mg.A[l], mg.P[l], mg.AP[l], true);
+        sparse_product(mg.R[l], mg.AP[l], mg.A[l+1], true);
+    }
+    for (int l=0; l<mg.A.size(); l++){
+        for (int i=0; i<mg.A[l].rows; i++){
+            for (int p=mg.A[l].row_start[i]; p<mg.A[l].row_start[i+1]; p++){
+                if (mg.A[l].column[p] == i){
+                    mg.diagonal_inv[l][i] = 1.0f/mg.A[l].value[p];
+                }
+            }
+        }
+    }
+    
+    vector<float> &b = mg.rhs;
+    vector<float> &v = mg.v;
+    fill(b.begin(), b.end(), 0.0f); //gap rows solve to zero
+    fill(v.begin(), v.end(), 0.0f);
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        for (int i=bodies[b_i].first_mass; i<bodies[b_i].first_mass + bodies[b_i].num_masses; i++){
+            for (int n=0; n<3; n++){
+                b[3*i + n] = masses[i].mass*masses[i].velocity[n] + dt*masses[i].forces[n];
+                v[3*i + n] = masses[i].velocity[n];
+            }
+        }
+    }
+    multigrid_solve(mg, b, v);
+    //-------------------------------------
+    
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        for (int i=bodies[b_i].first_mass; i<bodies[b_i].first_mass + bodies[b_i].num_masses; i++){
+            for (int n=0; n<3; n++){
+                masses[i].acceleration[n] = (v[3*i + n] - masses[i].velocity[n])/dt;
+                masses[i].velocity[n] = v[3*i + n];
+                masses[i].position[n] = masses[i].position[n] + v[3*i + n]*dt;
+            }
+        }
+    }
+}
+
+//Move spring `from` into slot `to` and patch everything that refers to springs by index
+void pool_move(Pool &pool, int from, int to);
+void pool_destroy(Pool &pool, int slot);
+
+void move_spring(vector<Spring> &springs, Multigrid &mg, int from, int to){
+    springs[to] = springs[from];
+    pool_move(spring_pool, from, to);
+    if (!mg.spring_blocks.empty()){
+        for (int n=0; n<4; n++){
+            mg.spring_blocks[4*to + n] = mg.spring_blocks[4*from + n];
+        }
+    }
+    for (int a=0; a<breathing_springs.size(); a++){
+        if (breathing_springs[a] == from){
+            breathing_springs[a] = to;
+        }
+    }
+}
+
+//Stops actuating a spring that is being removed, its entry stays behind as -1
+void forget_breathing(int spring){
+    for (int a=0; a<breathing_springs.size(); a++){
+        if (breathing_springs[a] == spring){
+            breathing_springs[a] = -1;
+        }
+    }
+}
+
+void update_fracture(vector<Spring> &springs, vector<Body> &bodies, Multigrid &mg){
+    
+    //Swap-remove the broken springs of every body, leaving the holes at the end of its range
+    //-------------------------------------
+    static vector<int> removed; //kept between calls, this runs every step
+    removed.assign(bodies.size(), 0);
+    int total = 0;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        if (bodies[b_i].asleep){
+            continue;
+        }
+        int first = bodies[b_i].first_spring;
+        for (int i=first + bodies[b_i].num_springs - 1; i>=first; i--){
+            Spring &spring = springs[i];
+            if (spring.rigid || fabs(spring.L - spring.L0) <= spring.max_strain*spring.L0){
+                continue;
+            }
+            forget_breathing(i);
+            pool_destroy(spring_pool, i);
+            int last = first + bodies[b_i].num_springs - 1;
+            if (i != last){
+                move_spring(springs, mg, last, i);
+            }
+            bodies[b_i].num_springs -= 1;
+            removed[b_i] += 1;
+            total += 1;
+        }
+    }
+    if (total == 0){
+        return;
+    }
+    //-------------------------------------
+    
+    //Close the holes by moving the tail of every later body forward
+    //-------------------------------------
+    int shift = 0;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        int first = bodies[b_i].first_spring;
+        int num = bodies[b_i].num_springs;
+        if (shift > 0){
+            int moves = min(shift, num);
+            for (int m=0; m<moves; m++){
+                move_spring(springs, mg, first + num - 1 - m, first - shift + m);
+            }
+            bodies[b_i].first_spring -= shift;
+        }
+        shift += removed[b_i];
+    }
+    springs.resize(springs.size() - shift);
+    if (!mg.spring_blocks.empty()){
+        mg.spring_blocks.resize(4*springs.size());
+    }
+    //-------------------------------------
+}
+
+void initialize_pools(vector<PointMass> &masses, vector<Spring> &springs){
+    //Every mass and spring created so far gets the id of its slot
+    mass_pool = Pool();
+    spring_pool = Pool();
+    for (int i=0; i<masses.size(); i++){
+        mass_pool.slot.push_back(i);
+        mass_pool.generation.push_back(0);
+        mass_pool.id_of_slot.push_back(i);
+    }
+    for (int i=0; i<springs.size(); i++){
+        spring_pool.slot.push_back(i);
+        spring_pool.generation.push_back(0);
+        spring_pool.id_of_slot.push_back(i);
+    }
+    masses.reserve(masses.size() + pool_reserve);
+    springs.reserve(springs.size() + pool_reserve);
+}
+
+//Handle to whatever is in a slot now, a stale one for a slot that is not in use
+Handle pool_handle(Pool &pool, int slot){
+    if (slot >= pool.id_of_slot.size() || pool.id_of_slot[slot] < 0){
+        return {-1, 0};
+    }
+    int id = pool.id_of_slot[slot];
+    return {id, pool.generation[id]};
+}
+
+int pool_slot(Pool &pool, Handle handle){
+    if (handle.id < 0 || handle.id >= pool.slot.size() || pool.generation[handle.id] != handle.generation){
+        return -1; //removed since the handle was made
+    }
+    return pool.slot[handle.id];
+}
+
+Handle pool_create(Pool &pool, int slot){
+    int id;
+    if (!pool.free_ids.empty()){
+        id = pool.free_ids.back();
+        pool.free_ids.pop_back();
+    }
+    else{
+        id = (int)pool.slot.size();
+        pool.slot.push_back(-1);
+        pool.generation.push_back(0);
+    }
+    pool.slot[id] = slot;
+    if (slot >= pool.id_of_slot.size()){
+        pool.id_of_slot.resize(slot + 1, -1);
+    }
+    pool.id_of_slot[slot] = id;
+    return {id, pool.generation[id]};
+}
+
+void pool_destroy(Pool &pool, int slot){
+    if (slot >= pool.id_of_slot.size() || pool.id_of_slot[slot] < 0){
+        return;
+    }
+    int id = pool.id_of_slot[slot];
+    pool.slot[id] = -1;
+    pool.generation[id] += 1;
+    pool.free_ids.push_back(id);
+    pool.id_of_slot[slot] = -1;
+}
+
+void pool_move(Pool &pool, int from, int to){
+    if (from >= pool.id_of_slot.size()){
+        return;
+    }
+    if (to >= pool.id_of_slot.size()){
+        pool.id_of_slot.resize(to + 1, -1);
+    }
+    int id = pool.id_of_slot[from];
+    pool.id_of_slot[to] = id;
+    pool.id_of_slot[from] = -1;
+    if (id >= 0){
+        pool.slot[id] = to;
+    }
+}
+
+//First slot after the masses of body b_i that another body uses (or the end of the array)
+int next_mass_start(vector<PointMass> &masses, vector<Body> &bodies, int b_i){
+    return b_i + 1 < bodies.size() ? bodies[b_i+1].first_mass : (int)masses.size();
+}
+
+int next_spring_start(vector<Spring> &springs, vector<Body> &bodies, int b_i){
+    return b_i + 1 < bodies.size() ? bodies[b_i+1].first_spring : (int)springs.size();
+}
+
+//Point every spring, tetrahedron and cluster member that uses mass `from` at `to` instead
+void rename_mass(vector<Spring> &springs, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters, int from, int to){
+    for (int s=0; s<springs.size(); s++){
+        if (springs[s].m0 == from){
+            springs[s].m0 = to;
+        }
+        if (springs[s].m1 == from){
+            springs[s].m1 = to;
+        }
+    }
+    for (int t=0; t<tets.size(); t++){
+        for (int k=0; k<4; k++){
+            if (tets[t].m[k] == from){
+                tets[t].m[k] = to;
+            }
+        }
+    }
+    for (int c=0; c<clusters.size(); c++){
+        for (int &member : clusters[c].members){
+            if (member == from){
+                member = to;
+            }
+        }
+    }
+}
+
+//The multigrid hierarchy and the modal basis are laid out per mass slot at startup, so masses can only be added
+//or removed on the explicit path
+Handle add_mass(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters, int body, PointMass &mass){
+    if (implicit || modal){
+        throw(EBUSY);
+    }
+    int slot = bodies[body].first_mass + bodies[body].num_masses;
+    
+    if (body == bodies.size() - 1){
+        masses.push_back(mass); //within the reserved capacity
+    }
+    else if (slot < next_mass_start(masses, bodies, body)){
+        masses[slot] = mass; //reuse a slot freed by an earlier removal
+    }
+    else{
+        //Open a slot by moving the first mass of every later body to its end, last body first so no move
+        //lands on a slot that is still in use
+        //-------------------------------------
+        for (int c=(int)bodies.size()-1; c>body; c--){
+            int first = bodies[c].first_mass;
+            int end = first + bodies[c].num_masses;
+            if (end == masses.size()){
+                masses.push_back(masses[first]);
+            }
+            else{
+                masses[end] = masses[first];
+            }
+            pool_move(mass_pool, first, end);
+            rename_mass(springs, tets, clusters, first, end);
+            bodies[c].first_mass += 1;
+        }
+        //-------------------------------------
+        masses[slot] = mass;
+    }
+    bodies[body].num_masses += 1;
+    wake_body(bodies[body]);
+    return pool_create(mass_pool, slot);
+}
+
+Handle add_spring(vector<Spring> &springs, vector<Body> &bodies, int body, Spring &spring){
+    int slot = bodies[body].first_spring + bodies[body].num_springs;
+    
+    if (body == bodies.size() - 1){
+        springs.push_back(spring);
+    }
+    else if (slot < next_spring_start(springs, bodies, body)){
+        springs[slot] = spring;
+    }
+    else{
+        //Open a slot by moving the first spring of every later body to its end
+        Multigrid none;
+        for (int c=(int)bodies.size()-1; c>body; c--){
+            int first = bodies[c].first_spring;
+            int end = first + bodies[c].num_springs;
+            if (end == springs.size()){
+                springs.push_back(Spring());
+            }
+            move_spring(springs, none, first, end);
+            bodies[c].first_spring += 1;
+        }
+        springs[slot] = spring;
+    }
+    bodies[body].num_springs += 1;
+    wake_body(bodies[body]);
+    return pool_create(spring_pool, slot);
+}
+
+//Swap-remove spring `slot` of body b_i, the freed slot becomes a gap until compact_pools
+void remove_spring_slot(vector<Spring> &springs, vector<Body> &bodies, int b_i, int slot){
+    Multigrid none;
+    forget_breathing(slot);
+    pool_destroy(spring_pool, slot);
+    int last = bodies[b_i].first_spring + bodies[b_i].num_springs - 1;
+    if (slot != last){
+        move_spring(springs, none, last, slot);
+    }
+    bodies[b_i].num_springs -= 1;
+    if (b_i == bodies.size() - 1){
+        springs.pop_back();
+    }
+    wake_body(bodies[b_i]);
+}
+
+void remove_spring(vector<Spring> &springs, vector<Body> &bodies, Handle handle){
+    int slot = pool_slot(spring_pool, handle);
+    if (slot < 0){
+        return;
+    }
+    remove_spring_slot(springs, bodies, body_of_spring(bodies, slot), slot);
+}
+
+//Springs and tetrahedra attached to the mass go with it, a member of a rigid cluster cannot be removed since the
+//cluster's mass and inertia would no longer match its members
+void remove_mass(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters, Handle handle){
+    if (implicit || modal){
+        throw(EBUSY);
+    }
+    int slot = pool_slot(mass_pool, handle);
+    if (slot < 0){
+        return;
+    }
+    if (masses[slot].cluster >= 0){
+        throw(EBUSY);
+    }
+    
+    for (int t=(int)tets.size()-1; t>=0; t--){
+        for (int k=0; k<4; k++){
+            if (tets[t].m[k] == slot){
+                tets[t] = tets.back();
+                tets.pop_back();
+                break;
+            }
+        }
+    }
+    
+    //springs attached to the mass go with it
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        int first = bodies[b_i].first_spring;
+        for (int s=first + bodies[b_i].num_springs - 1; s>=first; s--){
+            if (springs[s].m0 == slot || springs[s].m1 == slot){
+                remove_spring_slot(springs, bodies, b_i, s);
+            }
+        }
+    }
+    
+    int body = body_of_mass(bodies, slot);
+    int last = bodies[body].first_mass + bodies[body].num_masses - 1;
+    pool_destroy(mass_pool, slot);
+    if (slot != last){
+        masses[slot] = masses[last];
+        pool_move(mass_pool, last, slot);
+        rename_mass(springs, tets, clusters, last, slot);
+    }
+    bodies[body].num_masses -= 1;
+    if (body == bodies.size() - 1){
+        masses.pop_back();
+    }
+    wake_body(bodies[body]);
+}
+
+//Puts a payload of payload_mass above the payload_supports highest masses of body, on one spring to each of them
+Handle attach_payload(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters, int body){
+    vector<int> supports;
+    for (int i=bodies[body].first_mass; i<bodies[body].first_mass + bodies[body].num_masses; i++){
+        supports.push_back(i);
+    }
+    int num_supports = min(payload_supports, (int)supports.size());
+    partial_sort(supports.begin(), supports.begin() + num_supports, supports.end(), [&](int i, int j){
+        return masses[i].position[2] > masses[j].position[2];
+    });
+    supports.resize(num_supports);
+    
+    PointMass payload;
+    payload.mass = payload_mass;
+    payload.position = {0.0f, 0.0f, 0.0f};
+    payload.velocity = {0.0f, 0.0f, 0.0f};
+    payload.acceleration = {0.0f, 0.0f, 0.0f};
+    payload.forces = {0.0f, 0.0f, 0.0f};
+    for (int i : supports){
+        for (int n=0; n<3; n++){
+            payload.position[n] += masses[i].position[n]/num_supports;
+            payload.velocity[n] += masses[i].velocity[n]/num_supports;
+        }
+    }
+    payload.position[2] += payload_height;
+    
+    //masses of this body keep their slots when add_mass opens one
+    Handle handle = add_mass(masses, springs, bodies, tets, clusters, body, payload);
+    int slot = pool_slot(mass_pool, handle);
+    for (int i : supports){
+        Spring spring;
+        spring.m0 = slot;
+        spring.m1 = i;
+        spring.k = spring_constant;
+        float L = 0;
+        for (int n=0; n<3; n++){
+            L += pow(masses[i].position[n] - masses[slot].position[n], 2);
+        }
+        spring.L0 = spring.L = spring.original_L0 = sqrt(L);
+        add_spring(springs, bodies, body, spring);
+    }
+    return handle;
+}
+
+bool has_gaps(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies){
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        if (bodies[b_i].first_mass + bodies[b_i].num_masses != next_mass_start(masses, bodies, b_i) ||
+            bodies[b_i].first_spring + bodies[b_i].num_springs != next_spring_start(springs, bodies, b_i)){
+            return true;
+        }
+    }
+    return false;
+}
+
+void compact_pools(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Tetrahedron> &tets, vector<RigidCluster> &clusters){
+    
+    //Slide every body down over the gaps before it, remembering where the masses went
+    //-------------------------------------
+    vector<int> remap(masses.size());
+    for (int i=0; i<masses.size(); i++){
+        remap[i] = i;
+    }
+    int mass_end = 0;
+    int spring_end = 0;
+    Multigrid none;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        Body &body = bodies[b_i];
+        int shift = body.first_mass - mass_end;
+        if (shift > 0){
+            int moves = min(shift, body.num_masses);
+            for (int m=0; m<moves; m++){
+                int from = body.first_mass + body.num_masses - 1 - m;
+                int to = mass_end + m;
+                masses[to] = masses[from];
+                pool_move(mass_pool, from, to);
+                remap[from] = to;
+            }
+            body.first_mass = mass_end;
+        }
+        mass_end += body.num_masses;
+        
+        shift = body.first_spring - spring_end;
+        if (shift > 0){
+            int moves = min(shift, body.num_springs);
+            for (int m=0; m<moves; m++){
+                move_spring(springs, none, body.first_spring + body.num_springs - 1 - m, spring_end + m);
+            }
+            body.first_spring = spring_end;
+        }
+        spring_end += body.num_springs;
+    }
+    masses.resize(mass_end);
+    springs.resize(spring_end);
+    //-------------------------------------
+    
+    for (int s=0; s<springs.size(); s++){
+        springs[s].m0 = remap[springs[s].m0];
+        springs[s].m1 = remap[springs[s].m1];
+    }
+    for (int t=0; t<tets.size(); t++){
+        for (int k=0; k<4; k++){
+            tets[t].m[k] = remap[tets[t].m[k]];
+        }
+    }
+    for (int c=0; c<clusters.size(); c++){
+        for (int &member : clusters[c].members){
+            member = remap[member];
+        }
+    }
+}
+
+void build_lattice(vector<char> &occupancy, int nx, int ny, int nz, float spacing, float origin[3], vector<PointMass> &masses, vector<Spring> &springs, vector<Tetrahedron> &tets){
+    //occupancy holds one entry per cube, x fastest: occupancy[(k*ny + j)*nx + i], every occupied cube is made of material 1
+    Genome genome;
+    genome.nx = nx;
+    genome.ny = ny;
+    genome.nz = nz;
+    genome.voxels = occupancy;
+    vector<Material> materials = {{spring_constant, 0.5f, 0.0f, 0.0f}};
+    vector<int> vertex_id;
+    vector<Body> bodies;
+    masses.clear();
+    springs.clear();
+    compile_genome(genome, materials, spacing, origin, vertex_id, masses, springs, bodies);
+    masses.resize(bodies[0].num_masses);
+    springs.resize(bodies[0].num_springs);
+    
+    //With tetrahedra every occupied cube is split into 5 instead, alternating parity like a checkerboard
+    //-------------------------------------
+    tets.clear();
+    if (tetrahedra){
+        int vx = nx + 1;
+        int vy = ny + 1;
+        for (int k=0; k<nz; k++){
+            for (int j=0; j<ny; j++){
+                for (int i=0; i<nx; i++){
+                    if (occupancy[(k*ny + j)*nx + i] == 0){
+                        continue;
+                    }
+                    int corners[8];
+                    for (int corner=0; corner<8; corner++){
+                        corners[corner] = vertex_id[((k + ((corner >> 2) & 1))*vy + j + ((corner >> 1) & 1))*vx + i + (corner & 1)];
+                    }
+                    add_cube_tets(masses, tets, corners, (i + j + k) % 2);
+                }
+            }
+        }
+        springs.clear();
+    }
+    //-------------------------------------
+}
+
+void compile_genome(Genome &genome, vector<Material> &materials, float spacing, float origin[3], vector<int> &vertex_id, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies){
+    //The body is written over slots 0.. of masses and springs, which only grow when a genome needs more,
+    //so after the largest genome nothing is allocated and slots past the body's ranges are spare capacity
+    int nx = genome.nx;
+    int ny = genome.ny;
+    int nz = genome.nz;
+    int vx = nx + 1;
+    int vy = ny + 1;
+    int vz = nz + 1;
+    auto material = [&](int i, int j, int k){
+        if (i < 0 || j < 0 || k < 0 || i >= nx || j >= ny || k >= nz){
+            return 0;
+        }
+        return (int)genome.voxels[(k*ny + j)*nx + i];
+    };
+    
+    //Vertices: the lattice coordinates index a table of mass ids, so shared corners are created once
+    //-------------------------------------
+    vertex_id.assign(vx*vy*vz, -1);
+    int num_masses = 0;
+    for (int k=0; k<vz; k++){
+        for (int j=0; j<vy; j++){
+            for (int i=0; i<vx; i++){
+                bool used = false;
+                for (int corner=0; corner<8 && !used; corner++){
+                    used = material(i - (corner & 1), j - ((corner >> 1) & 1), k - ((corner >> 2) & 1)) != 0;
+                }
+                if (used){
+                    vertex_id[(k*vy + j)*vx + i] = num_masses++;
+                }
+            }
+        }
+    }
+    if (masses.size() < num_masses){
+        masses.resize(num_masses);
+    }
+    for (int k=0; k<vz; k++){
+        for (int j=0; j<vy; j++){
+            for (int i=0; i<vx; i++){
+                int id = vertex_id[(k*vy + j)*vx + i];
+                if (id < 0){
+                    continue;
+                }
+                PointMass &mass = masses[id];
+                mass.mass = lattice_mass;
+                mass.position = {origin[0] + i*spacing, origin[1] + j*spacing, origin[2] + k*spacing};
+                mass.velocity = {0.0f, 0.0f, 0.0f};
+                mass.acceleration = {0.0f, 0.0f, 0.0f};
+                mass.forces = {0.0f, 0.0f, 0.0f};
+                mass.last_obstacle = -1;
+                mass.last_triangle = -1;
+                mass.cluster = -1;
+            }
+        }
+    }
+    //-------------------------------------
+    
+    //Springs: every vertex owns the 13 directions of one half of its neighbourhood, so every edge,
+    //face diagonal and body diagonal shared by several cubes is visited exactly once
+    //-------------------------------------
+    static const int directions[13][3] = {
+        {1, 0, 0}, {0, 1, 0}, {0, 0, 1},
+        {1, 1, 0}, {1, -1, 0}, {1, 0, 1}, {1, 0, -1}, {0, 1, 1}, {0, 1, -1},
+        {1, 1, 1}, {1, 1, -1}, {1, -1, 1}, {1, -1, -1}
+    };
+    springs.reserve(13*num_masses);
+    breathing_springs.clear();
+    int num_springs = 0;
+    for (int k=0; k<vz; k++){
+        for (int j=0; j<vy; j++){
+            for (int i=0; i<vx; i++){
+                int id = vertex_id[(k*vy + j)*vx + i];
+                if (id < 0){
+                    continue;
+                }
+                for (int d=0; d<13; d++){
+                    int dx = directions[d][0];
+                    int dy = directions[d][1];
+                    int dz = directions[d][2];
+                    int i1 = i + dx;
+                    int j1 = j + dy;
+                    int k1 = k + dz;
+                    if (i1 < 0 || j1 < 0 || k1 < 0 || i1 >= vx || j1 >= vy || k1 >= vz){
+                        continue;
+                    }
+                    
+                    //the spring takes the material of the first occupied cube containing both ends,
+                    //along an axis with no step those are the cubes on either side
+                    int low[3] = {min(i, i1), min(j, j1), min(k, k1)};
+                    int step[3] = {dx, dy, dz};
+                    int m = 0;
+                    for (int side=0; side<8 && m == 0; side++){
+                        int cell[3];
+                        bool valid = true;
+                        for (int n=0; n<3; n++){
+                            int bit = (side >> n) & 1;
+                            if (step[n] != 0 && bit){
+                                valid = false; //only one cube along an axis with a step
+                            }
+                            cell[n] = low[n] - (step[n] == 0 ? bit : 0);
+                        }
+                        if (valid){
+                            m = material(cell[0], cell[1], cell[2]);
+                        }
+                    }
+                    if (m == 0){
+                        continue;
+                    }
+                    
+                    if (springs.size() <= num_springs){
+                        springs.emplace_back();
+                    }
+                    Material &properties = materials[m - 1];
+                    Spring &spring = springs[num_springs];
+                    spring.L0 = spacing*sqrt((float)(dx*dx + dy*dy + dz*dz));
+                    spring.L = spring.L0;
+                    spring.k = properties.k;
+                    spring.m0 = id;
+                    spring.m1 = vertex_id[(k1*vy + j1)*vx + i1];
+                    spring.original_L0 = spring.L0;
+                    spring.rigid = false;
+                    spring.max_strain = properties.max_strain;
+                    spring.amplitude = properties.amplitude;
+                    spring.phase = properties.phase;
+                    if (properties.amplitude != 0.0f){
+                        breathing_springs.push_back(num_springs);
+                    }
+                    num_springs += 1;
+                }
+            }
+        }
+    }
+    //-------------------------------------
+    
+    Body body;
+    body.first_mass = 0;
+    body.num_masses = num_masses;
+    body.first_spring = 0;
+    body.num_springs = num_springs;
+    body.asleep = false;
+    body.still_steps = 0;
+    bodies.resize(1);
+    bodies[0] = body;
+}
+
+Genome voxelize(vector<Triangle> &triangles, int resolution, float &spacing, float origin[3]){
+    //Cubes of material 1 wherever the centre of the cube is inside the closed mesh, resolution cubes along its longest side
+    //-------------------------------------
+    float box_min[3] = {INFINITY, INFINITY, INFINITY};
+    float box_max[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (Triangle &triangle : triangles){
+        for (int n=0; n<3; n++){
+            box_min[n] = min({box_min[n], triangle.v0[n], triangle.v1[n], triangle.v2[n]});
+            box_max[n] = max({box_max[n], triangle.v0[n], triangle.v1[n], triangle.v2[n]});
+        }
+    }
+    Genome genome;
+    genome.nx = genome.ny = genome.nz = 0;
+    spacing = max({box_max[0] - box_min[0], box_max[1] - box_min[1], box_max[2] - box_min[2]})/resolution;
+    if (triangles.empty() || !(spacing > 0)){
+        return genome;
+    }
+    int size[3];
+    for (int n=0; n<3; n++){
+        origin[n] = box_min[n];
+        size[n] = max(1, (int)ceil((box_max[n] - box_min[n])/spacing));
+    }
+    genome.nx = size[0];
+    genome.ny = size[1];
+    genome.nz = size[2];
+    genome.voxels.assign(size[0]*size[1]*size[2], 0);
+    //-------------------------------------
+    
+    //Every thread fills a band of z slices. A ray along x through the centre of every row of cubes
+    //crosses the surface an even number of times, the cubes between the 1st and 2nd, 3rd and 4th... are inside
+    //-------------------------------------
+    auto fill_slices = [&](int k_begin, int k_end){
+        //triangles sorted into the slices of this band they span
+        vector<vector<int>> slice_triangles(k_end - k_begin);
+        for (int t=0; t<triangles.size(); t++){
+            Triangle &triangle = triangles[t];
+            float z_min = min({triangle.v0[2], triangle.v1[2], triangle.v2[2]});
+            float z_max = max({triangle.v0[2], triangle.v1[2], triangle.v2[2]});
+            int k0 = max(k_begin, (int)ceil((z_min - origin[2])/spacing - 0.5f));
+            int k1 = min(k_end - 1, (int)floor((z_max - origin[2])/spacing - 0.5f));
+            for (int k=k0; k<=k1; k++){
+                slice_triangles[k - k_begin].push_back(t);
+            }
+        }
+        
+        vector<vector<float>> crossings(size[1]);
+        for (int k=k_begin; k<k_end; k++){
+            double z = origin[2] + (k + 0.5)*spacing;
+            for (int t : slice_triangles[k - k_begin]){
+                Triangle &triangle = triangles[t];
+                double y_c[3] = {triangle.v0[1], triangle.v1[1], triangle.v2[1]};
+                double z_c[3] = {triangle.v0[2], triangle.v1[2], triangle.v2[2]};
+                double x_c[3] = {triangle.v0[0], triangle.v1[0], triangle.v2[0]};
+                double area = (y_c[1] - y_c[0])*(z_c[2] - z_c[0]) - (z_c[1] - z_c[0])*(y_c[2] - y_c[0]);
+                if (area == 0){
+                    continue; //parallel to the rays
+                }
+                if (area < 0){
+                    swap(y_c[1], y_c[2]);
+                    swap(z_c[1], z_c[2]);
+                    swap(x_c[1], x_c[2]);
+                    area = -area;
+                }
+                int j0 = max(0, (int)ceil((min({y_c[0], y_c[1], y_c[2]}) - origin[1])/spacing - 0.5));
+                int j1 = min(size[1] - 1, (int)floor((max({y_c[0], y_c[1], y_c[2]}) - origin[1])/spacing - 0.5));
+                for (int j=j0; j<=j1; j++){
+                    double y = origin[1] + (j + 0.5)*spacing;
+                    
+                    //edge functions of the triangle projected onto the yz plane, a ray through an edge
+                    //counts for only one of the two triangles sharing it (top-left rule)
+                    double weight[3];
+                    bool inside = true;
+                    for (int e=0; e<3 && inside; e++){
+                        int a = (e + 1)%3;
+                        int b = (e + 2)%3;
+                        double dy = y_c[b] - y_c[a];
+                        double dz = z_c[b] - z_c[a];
+                        weight[e] = dy*(z - z_c[a]) - dz*(y - y_c[a]);
+                        bool top_left = dz < 0 || (dz == 0 && dy > 0);
+                        inside = weight[e] > 0 || (weight[e] == 0 && top_left);
+                    }
+                    if (inside){
+                        crossings[j].push_back((float)((weight[0]*x_c[0] + weight[1]*x_c[1] + weight[2]*x_c[2])/area));
+                    }
+                }
+            }
+            
+            for (int j=0; j<size[1]; j++){
+                vector<float> &row = crossings[j];
+                sort(row.begin(), row.end());
+                for (int c=0; c+1<row.size(); c+=2){
+                    int i0 = max(0, (int)ceil((row[c] - origin[0])/spacing - 0.5f));
+                    int i1 = min(size[0] - 1, (int)ceil((row[c+1] - origin[0])/spacing - 0.5f) - 1);
+                    for (int i=i0; i<=i1; i++){
+                        genome.voxels[(k*size[1] + j)*size[0] + i] = 1;
+                    }
+                }
+                row.clear();
+            }
+        }
+    };
+    
+    int num_threads = max(1, min((int)thread::hardware_concurrency(), size[2]));
+    vector<thread> threads;
+    for (int t=0; t<num_threads; t++){
+        threads.emplace_back(fill_slices, t*size[2]/num_threads, (t + 1)*size[2]/num_threads);
+    }
+    for (thread &worker : threads){
+        worker.join();
+    }
+    //-------------------------------------
+    
+    return genome;
+}
+
+void connect_within(vector<PointMass> &masses, float r, vector<Spring> &springs){
+    //Appends a spring between every pair of masses closer than r, resting at their current distance
+    int num_masses = (int)masses.size();
+    if (num_masses < 2 || !(r > 0)){
+        return;
+    }
+    
+    //Cell list: cubes of side r (larger if the cloud is sparse enough that the grid would outgrow it),
+    //so the partners of a mass are all in the 27 cells around its own
+    //-------------------------------------
+    float box_min[3] = {INFINITY, INFINITY, INFINITY};
+    float box_max[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i=0; i<num_masses; i++){
+        for (int n=0; n<3; n++){
+            box_min[n] = min(box_min[n], masses[i].position[n]);
+            box_max[n] = max(box_max[n], masses[i].position[n]);
+        }
+    }
+    float cell_size = r;
+    long size[3];
+    while (true){
+        for (int n=0; n<3; n++){
+            size[n] = (long)((box_max[n] - box_min[n])/cell_size) + 1;
+        }
+        if (size[0]*size[1]*size[2] <= 8L*num_masses){
+            break;
+        }
+        cell_size *= 2.0f;
+    }
+    int num_cells = (int)(size[0]*size[1]*size[2]);
+    
+    vector<int> cell_of(num_masses);
+    vector<int> cell_start(num_cells + 1, 0);
+    for (int i=0; i<num_masses; i++){
+        int c[3];
+        for (int n=0; n<3; n++){
+            c[n] = min((int)size[n] - 1, (int)((masses[i].position[n] - box_min[n])/cell_size));
+        }
+        cell_of[i] = (int)((c[2]*size[1] + c[1])*size[0] + c[0]);
+        cell_start[cell_of[i] + 1] += 1;
+    }
+    for (int c=0; c<num_cells; c++){
+        cell_start[c + 1] += cell_start[c];
+    }
+    vector<int> sorted(num_masses);
+    vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+    for (int i=0; i<num_masses; i++){
+        sorted[fill[cell_of[i]]++] = i; //counting sort, masses stay in index order inside a cell
+    }
+    vector<float> points(3*num_masses); //positions in sorted order, so a cell's masses are contiguous
+    for (int a=0; a<num_masses; a++){
+        for (int n=0; n<3; n++){
+            points[3*a + n] = masses[sorted[a]].position[n];
+        }
+    }
+    //-------------------------------------
+    
+    //Pairs: every mass looks at the cells around it and keeps the partners later in sorted order
+    //-------------------------------------
+    float r_2 = r*r;
+    for (int c=0; c<num_cells; c++){
+        if (cell_start[c] == cell_start[c + 1]){
+            continue;
+        }
+        int c0 = (int)(c%size[0]);
+        int c1 = (int)((c/size[0])%size[1]);
+        int c2 = (int)(c/(size[0]*size[1]));
+        for (int d2=max(0, c2 - 1); d2<=min((int)size[2] - 1, c2 + 1); d2++){
+            for (int d1=max(0, c1 - 1); d1<=min((int)size[1] - 1, c1 + 1); d1++){
+                for (int d0=max(0, c0 - 1); d0<=min((int)size[0] - 1, c0 + 1); d0++){
+                    int neighbour = (int)((d2*size[1] + d1)*size[0] + d0);
+                    for (int a=cell_start[c]; a<cell_start[c + 1]; a++){
+                        for (int b=max(a + 1, cell_start[neighbour]); b<cell_start[neighbour + 1]; b++){
+                            float dx = points[3*a] - points[3*b];
+                            float dy = points[3*a + 1] - points[3*b + 1];
+                            float dz = points[3*a + 2] - points[3*b + 2];
+                            float distance_2 = dx*dx + dy*dy + dz*dz;
+                            if (distance_2 >= r_2 || distance_2 == 0){
+                                continue;
+                            }
+                            Spring spring;
+                            spring.L0 = sqrt(distance_2);
+                            spring.L = spring.L0;
+                            spring.k = spring_constant;
+                            spring.m0 = sorted[a];
+                            spring.m1 = sorted[b];
+                            spring.original_L0 = spring.L0;
+                            springs.push_back(spring);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    //-------------------------------------
+}
+
+//Moves a free pebble to vertex `to` by reversing a path of directed springs, never taking one from `held`
+bool gather_pebble(vector<int> &pebbles, vector<vector<int>> &out, int to, int held, vector<int> &seen, vector<int> &parent, int stamp){
+    vector<int> stack = {to};
+    seen[to] = stamp;
+    while (!stack.empty()){
+        int x = stack.back();
+        stack.pop_back();
+        for (int y : out[x]){
+            if (seen[y] == stamp){
+                continue;
+            }
+            seen[y] = stamp;
+            parent[y] = x;
+            if (y != held && pebbles[y] > 0){
+                for (int z=y; z!=to; z=parent[z]){
+                    vector<int> &from = out[parent[z]];
+                    from.erase(find(from.begin(), from.end(), z));
+                    out[z].push_back(parent[z]);
+                }
+                pebbles[y] -= 1;
+                pebbles[to] += 1;
+                return true;
+            }
+            stack.push_back(y);
+        }
+    }
+    return false;
+}
+
+//Compliance f.u with K u = f for every load, K the stiffness of the springs at positions x, by matrix-free CG.
+//f.u only grows over the CG iterations, so with a limit the solve stops as soon as one load passes it and returns false
+bool spring_compliances(vector<Spring> &springs, vector<double> &x, vector<vector<double>> &loads, double compliance[6], vector<vector<double>> &displacements, double* limit){
+    int N = (int)x.size();
+    vector<double> r(N), p(N), Kp(N);
+    displacements.assign(loads.size(), vector<double>(N, 0.0));
+    for (int l=0; l<loads.size(); l++){
+        vector<double> &f = loads[l];
+        vector<double> &u = displacements[l];
+        r = f;
+        p = f;
+        compliance[l] = 0;
+        double rr = inner_product(r.begin(), r.end(), r.begin(), 0.0);
+        double stop = 1e-12*rr;
+        for (int it=0; it<4*N && rr > stop; it++){
+            spring_stiffness_product(springs, x, p, Kp);
+            double pKp = inner_product(p.begin(), p.end(), Kp.begin(), 0.0);
+            if (!(pKp > 0)){
+                break; //a load on a floppy mode
+            }
+            double alpha = rr/pKp;
+            for (int n=0; n<N; n++){
+                u[n] += alpha*p[n];
+                r[n] -= alpha*Kp[n];
+            }
+            compliance[l] += alpha*inner_product(f.begin(), f.end(), p.begin(), 0.0);
+            if (limit && compliance[l] > limit[l]){
+                return false;
+            }
+            double rr_new = inner_product(r.begin(), r.end(), r.begin(), 0.0);
+            for (int n=0; n<N; n++){
+                p[n] = r[n] + (rr_new/rr)*p[n];
+            }
+            rr = rr_new;
+        }
+    }
+    return true;
+}
+
+void prune_springs(vector<PointMass> &masses, vector<Spring> &springs){
+    int num_masses = (int)masses.size();
+    int num_springs = (int)springs.size();
+    vector<char> actuated(num_springs, 0);
+    for (int i : breathing_springs){
+        if (i >= 0){
+            actuated[i] = 1;
+        }
+    }
+    
+    //Pebble game: every mass holds 3 pebbles and every independent spring takes one, a spring is redundant
+    //when the 6 pebbles of its ends cannot be gathered. A rigid 3D body has 3n-6 independent springs, but
+    //counting that exactly would need 7 pebbles on 2 masses, so the game runs with one pebble of slack
+    //(3n-5), which may keep a spring too many but never drops one the rigidity needs.
+    //Actuated springs are played first and short springs before long ones, so the diagonals are the ones left over.
+    //-------------------------------------
+    vector<int> order(num_springs);
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](int a, int b){
+        if (actuated[a] != actuated[b]){
+            return actuated[a] > actuated[b];
+        }
+        return springs[a].L0 < springs[b].L0;
+    });
+    vector<int> pebbles(num_masses, 3);
+    vector<vector<int>> out(num_masses);
+    vector<int> seen(num_masses, 0);
+    vector<int> parent(num_masses);
+    int stamp = 0;
+    vector<int> candidates;
+    for (int i : order){
+        int u = springs[i].m0;
+        int v = springs[i].m1;
+        while (pebbles[u] < 3 && gather_pebble(pebbles, out, u, v, seen, parent, ++stamp));
+        while (pebbles[v] < 3 && gather_pebble(pebbles, out, v, u, seen, parent, ++stamp));
+        if (u != v && pebbles[u] == 3 && pebbles[v] == 3){
+            pebbles[u] -= 1;
+            out[u].push_back(v);
+        }
+        else if (!actuated[i]){
+            candidates.push_back(i);
+        }
+    }
+    //-------------------------------------
+    
+    //Stiffness: stretching loads along x, y and z and shearing loads in the xy, yz and zx planes,
+    //with the rigid body modes projected out
+    //-------------------------------------
+    int N = 3*num_masses;
+    vector<double> x(N);
+    double centroid[3] = {0, 0, 0};
+    for (int i=0; i<num_masses; i++){
+        for (int n=0; n<3; n++){
+            x[3*i + n] = masses[i].position[n];
+            centroid[n] += masses[i].position[n]/num_masses;
+        }
+    }
+    vector<vector<double>> rigid(6, vector<double>(N, 0.0));
+    for (int i=0; i<num_masses; i++){
+        double r[3] = {x[3*i] - centroid[0], x[3*i + 1] - centroid[1], x[3*i + 2] - centroid[2]};
+        for (int n=0; n<3; n++){
+            rigid[n][3*i + n] = 1.0;
+            rigid[3 + n][3*i + (n + 1)%3] = -r[(n + 2)%3]; //rotation about axis n
+            rigid[3 + n][3*i + (n + 2)%3] = r[(n + 1)%3];
+        }
+    }
+    for (int a=0; a<6; a++){
+        for (int b=0; b<a; b++){
+            double dot = inner_product(rigid[a].begin(), rigid[a].end(), rigid[b].begin(), 0.0);
+            for (int n=0; n<N; n++){
+                rigid[a][n] -= dot*rigid[b][n];
+            }
+        }
+        double length = sqrt(inner_product(rigid[a].begin(), rigid[a].end(), rigid[a].begin(), 0.0));
+        for (int n=0; n<N; n++){
+            rigid[a][n] = length > 1e-12 ? rigid[a][n]/length : 0.0;
+        }
+    }
+    vector<vector<double>> loads(6, vector<double>(N, 0.0));
+    for (int l=0; l<6; l++){
+        int axis0 = l%3;
+        int axis1 = l < 3 ? axis0 : (axis0 + 1)%3;
+        for (int i=0; i<num_masses; i++){
+            loads[l][3*i + axis0] += x[3*i + axis1] - centroid[axis1];
+            if (axis1 != axis0){
+                loads[l][3*i + axis1] += x[3*i + axis0] - centroid[axis0];
+            }
+        }
+        for (int a=0; a<6; a++){
+            double dot = inner_product(loads[l].begin(), loads[l].end(), rigid[a].begin(), 0.0);
+            for (int n=0; n<N; n++){
+                loads[l][n] -= dot*rigid[a][n];
+            }
+        }
+    }
+    double original[6];
+    vector<vector<double>> displacements;
+    spring_compliances(springs, x, loads, original, displacements, nullptr);
+    //-------------------------------------
+    
+    //Order the redundant springs by the share of the load they carry, removing a prefix of that order
+    //can only soften the body, so the longest prefix that keeps the stiffness is found by bisection.
+    //A spring is switched off by zeroing k while it is tried
+    //-------------------------------------
+    vector<double> energy(num_springs, 0.0);
+    for (int i : candidates){
+        int p0 = springs[i].m0;
+        int p1 = springs[i].m1;
+        double d[3];
+        for (int n=0; n<3; n++){
+            d[n] = x[3*p1 + n] - x[3*p0 + n];
+        }
+        double L = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        for (int l=0; l<6; l++){
+            vector<double> &u = displacements[l];
+            double along = 0;
+            for (int n=0; n<3; n++){
+                along += d[n]/L*(u[3*p1 + n] - u[3*p0 + n]);
+            }
+            energy[i] += springs[i].k*along*along/original[l];
+        }
+    }
+    stable_sort(candidates.begin(), candidates.end(), [&](int a, int b){
+        return energy[a] < energy[b];
+    });
+    
+    vector<float> stiffness(num_springs);
+    for (int i : candidates){
+        stiffness[i] = springs[i].k;
+    }
+    double limit[6];
+    for (int l=0; l<6; l++){
+        limit[l] = original[l]/(1.0 - prune_tolerance);
+    }
+    auto stiff_without = [&](int count){
+        for (int c=0; c<candidates.size(); c++){
+            springs[candidates[c]].k = c < count ? 0.0f : stiffness[candidates[c]];
+        }
+        double compliance[6];
+        return spring_compliances(springs, x, loads, compliance, displacements, limit);
+    };
+    int low = 0; //removing this many is known to keep the stiffness
+    int high = (int)candidates.size() + 1; //and this many is known not to
+    if (stiff_without(high - 1)){
+        low = high - 1;
+    }
+    else{
+        high -= 1;
+    }
+    while (high - low > 1){
+        int middle = (low + high)/2;
+        if (stiff_without(middle)){
+            low = middle;
+        }
+        else{
+            high = middle;
+        }
+    }
+    vector<char> removed(num_springs, 0);
+    for (int c=0; c<candidates.size(); c++){
+        springs[candidates[c]].k = stiffness[candidates[c]];
+        removed[candidates[c]] = c < low;
+    }
+    
+    vector<int> remap(num_springs, -1);
+    int kept = 0;
+    for (int i=0; i<num_springs; i++){
+        if (!removed[i]){
+            remap[i] = kept;
+            springs[kept++] = springs[i];
+        }
+    }
+    springs.resize(kept);
+    for (int a=0; a<breathing_springs.size(); a++){
+        if (breathing_springs[a] >= 0){
+            breathing_springs[a] = remap[breathing_springs[a]];
+        }
+    }
+    //-------------------------------------
+}
+
+bool little_endian(){
+    uint16_t probe = 1;
+    return *(uint8_t*)&probe == 1;
+}
+
+void save_body(const char* filename, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies){
+    if (!little_endian()){
+        throw(EINVAL); //the sections are used in place, so only little-endian hosts read and write them
+    }
+    
+    //Only the slots inside body ranges are written, packed and renumbered so gaps never reach the file
+    //-------------------------------------
+    vector<int> live_masses, live_springs;
+    vector<int32_t> mass_index(masses.size(), -1), spring_index(springs.size(), -1);
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        for (int i=bodies[b_i].first_mass; i<bodies[b_i].first_mass + bodies[b_i].num_masses; i++){
+            mass_index[i] = (int32_t)live_masses.size();
+            live_masses.push_back(i);
+        }
+        for (int i=bodies[b_i].first_spring; i<bodies[b_i].first_spring + bodies[b_i].num_springs; i++){
+            spring_index[i] = (int32_t)live_springs.size();
+            live_springs.push_back(i);
+        }
+    }
+    //-------------------------------------
+    
+    //Springs with the same k, max_strain and actuation share a material
+    //-------------------------------------
+    vector<Material> materials;
+    vector<int32_t> material(live_springs.size());
+    map<array<float, 4>, int> material_index;
+    for (int j=0; j<live_springs.size(); j++){
+        Spring &spring = springs[live_springs[j]];
+        array<float, 4> key = {spring.k, spring.max_strain, spring.amplitude, spring.phase};
+        auto found = material_index.find(key);
+        if (found == material_index.end()){
+            found = material_index.insert({key, (int)materials.size()}).first;
+            materials.push_back({key[0], key[1], key[2], key[3]});
+        }
+        material[j] = found->second;
+    }
+    //-------------------------------------
+    
+    //Lay out the sections and fill them in one buffer
+    //-------------------------------------
+    BodyFileHeader header = {};
+    memcpy(header.magic, "PSBODY", 6);
+    header.version = body_version;
+    header.num_masses = (uint32_t)live_masses.size();
+    header.num_springs = (uint32_t)live_springs.size();
+    header.num_materials = (uint32_t)materials.size();
+    vector<int32_t> live_actuated; //removed springs are not actuated any more
+    for (int i : breathing_springs){
+        if (i >= 0 && spring_index[i] >= 0){
+            live_actuated.push_back(spring_index[i]);
+        }
+    }
+    header.num_actuated = (uint32_t)live_actuated.size();
+    size_t sizes[8] = {
+        sizeof(double)*live_masses.size(), sizeof(float)*3*live_masses.size(), sizeof(float)*3*live_masses.size(),
+        sizeof(int32_t)*2*live_springs.size(), sizeof(float)*live_springs.size(), sizeof(int32_t)*live_springs.size(),
+        sizeof(float)*4*materials.size(), sizeof(int32_t)*live_actuated.size()
+    };
+    size_t end = sizeof(BodyFileHeader);
+    for (int section=0; section<8; section++){
+        end = (end + 63)/64*64;
+        header.offset[section] = end;
+        end += sizes[section];
+    }
+    vector<char> file(end, 0);
+    memcpy(file.data(), &header, sizeof(header));
+    double* mass = (double*)(file.data() + header.offset[0]);
+    float* position = (float*)(file.data() + header.offset[1]);
+    float* velocity = (float*)(file.data() + header.offset[2]);
+    int32_t* ends = (int32_t*)(file.data() + header.offset[3]);
+    float* rest_length = (float*)(file.data() + header.offset[4]);
+    memcpy(file.data() + header.offset[5], material.data(), sizes[5]);
+    float* properties = (float*)(file.data() + header.offset[6]);
+    int32_t* actuated = (int32_t*)(file.data() + header.offset[7]);
+    for (int j=0; j<live_masses.size(); j++){
+        PointMass &point = masses[live_masses[j]];
+        mass[j] = point.mass;
+        for (int n=0; n<3; n++){
+            position[3*j + n] = point.position[n];
+            velocity[3*j + n] = point.velocity[n];
+        }
+    }
+    for (int j=0; j<live_springs.size(); j++){
+        Spring &spring = springs[live_springs[j]];
+        ends[2*j] = mass_index[spring.m0];
+        ends[2*j + 1] = mass_index[spring.m1];
+        rest_length[j] = spring.original_L0;
+    }
+    for (int m=0; m<materials.size(); m++){
+        properties[4*m] = materials[m].k;
+        properties[4*m + 1] = materials[m].max_strain;
+        properties[4*m + 2] = materials[m].amplitude;
+        properties[4*m + 3] = materials[m].phase;
+    }
+    for (int a=0; a<live_actuated.size(); a++){
+        actuated[a] = live_actuated[a];
+    }
+    //-------------------------------------
+    
+    FILE* out = fopen(filename, "wb");
+    if (!out){
+        throw(errno);
+    }
+    size_t written = fwrite(file.data(), 1, file.size(), out);
+    fclose(out);
+    if (written != file.size()){
+        throw(EIO);
+    }
+}
+
+MappedBody map_body(const char* filename){
+    MappedBody body;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0){
+        throw(errno);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0){
+        int error = errno;
+        close(fd);
+        throw(error);
+    }
+    body.size = (size_t)info.st_size;
+    body.data = body.size >= sizeof(BodyFileHeader) ? mmap(nullptr, body.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (body.data == MAP_FAILED){
+        body.data = nullptr;
+        throw(EINVAL);
+    }
+    
+    //Check the header before handing out views of the sections
+    //-------------------------------------
+    body.header = (BodyFileHeader*)body.data;
+    BodyFileHeader &header = *body.header;
+    uint64_t counts[8] = {
+        header.num_masses, 3ull*header.num_masses, 3ull*header.num_masses,
+        2ull*header.num_springs, header.num_springs, header.num_springs,
+        4ull*header.num_materials, header.num_actuated
+    };
+    bool valid = little_endian() && memcmp(header.magic, "PSBODY\0\0", 8) == 0 && header.version == body_version;
+    for (int section=0; section<8 && valid; section++){
+        uint64_t size = counts[section]*(section == 0 ? sizeof(double) : 4);
+        valid = header.offset[section]%64 == 0 && header.offset[section] <= body.size && size <= body.size - header.offset[section];
+    }
+    if (!valid){
+        unmap_body(body);
+        throw(EINVAL);
+    }
+    //-------------------------------------
+    
+    char* base = (char*)body.data;
+    body.mass = (double*)(base + header.offset[0]);
+    body.position = (float*)(base + header.offset[1]);
+    body.velocity = (float*)(base + header.offset[2]);
+    body.ends = (int32_t*)(base + header.offset[3]);
+    body.rest_length = (float*)(base + header.offset[4]);
+    body.material = (int32_t*)(base + header.offset[5]);
+    body.materials = (float*)(base + header.offset[6]);
+    body.actuated = (int32_t*)(base + header.offset[7]);
+    return body;
+}
+
+void load_body(MappedBody &body, vector<PointMass> &masses, vector<Spring> &springs){
+    //The kernels read masses and springs as PointMass and Spring structs, not the mapped columns, so the columns are
+    //copied over in one pass and the mapping can be dropped afterwards. That skips parsing and conversion, but every
+    //mass still allocates its own position, velocity, acceleration and force vectors
+    BodyFileHeader &header = *body.header;
+    int num_masses = (int)header.num_masses;
+    int num_springs = (int)header.num_springs;
+    masses.resize(num_masses);
+    for (int i=0; i<num_masses; i++){
+        PointMass &mass = masses[i];
+        mass.mass = body.mass[i];
+        mass.position.assign(body.position + 3*i, body.position + 3*i + 3);
+        mass.velocity.assign(body.velocity + 3*i, body.velocity + 3*i + 3);
+        mass.acceleration = {0.0f, 0.0f, 0.0f};
+        mass.forces = {0.0f, 0.0f, 0.0f};
+    }
+    springs.resize(num_springs);
+    for (int i=0; i<num_springs; i++){
+        Spring &spring = springs[i];
+        int m = body.material[i];
+        if (body.ends[2*i] < 0 || body.ends[2*i] >= num_masses || body.ends[2*i + 1] < 0 || body.ends[2*i + 1] >= num_masses || m < 0 || m >= header.num_materials){
+            throw(EINVAL);
+        }
+        if (!(body.rest_length[i] > 0)){
+            throw(EINVAL); //zero length springs have no direction
+        }
+        spring.m0 = body.ends[2*i];
+        spring.m1 = body.ends[2*i + 1];
+        spring.L0 = body.rest_length[i];
+        spring.L = spring.L0;
+        spring.original_L0 = spring.L0;
+        spring.k = body.materials[4*m];
+        spring.max_strain = body.materials[4*m + 1];
+        spring.amplitude = body.materials[4*m + 2];
+        spring.phase = body.materials[4*m + 3];
+    }
+    breathing_springs.clear();
+    for (int a=0; a<header.num_actuated; a++){
+        if (body.actuated[a] < 0 || body.actuated[a] >= num_springs){
+            throw(EINVAL);
+        }
+        breathing_springs.push_back(body.actuated[a]);
+    }
+}
+
+void unmap_body(MappedBody &body){
+    if (body.data){
+        munmap(body.data, body.size);
+    }
+    body = MappedBody();
+}
+
+//Next token of the current statement, false at the end of the line or of the text. '#' starts a comment
+bool scene_token(SceneTokenizer &tok, const char* &begin, const char* &finish){
+    while (tok.at < tok.end && (*tok.at == ' ' || *tok.at == '\t' || *tok.at == '\r')){
+        tok.at++;
+    }
+    if (tok.at < tok.end && *tok.at == '#'){
+        while (tok.at < tok.end && *tok.at != '\n'){
+            tok.at++;
+        }
+    }
+    if (tok.at == tok.end || *tok.at == '\n'){
+        return false;
+    }
+    begin = tok.at;
+    while (tok.at < tok.end && *tok.at != ' ' && *tok.at != '\t' && *tok.at != '\r' && *tok.at != '\n' && *tok.at != '#'){
+        tok.at++;
+    }
+    finish = tok.at;
+    return true;
+}
+
+void scene_error(SceneTokenizer &tok, const char* message){
+    cout << "Scene error on line " << tok.line << ": " << message << endl;
+    throw(EINVAL);
+}
+
+double scene_number(SceneTokenizer &tok){
+    const char* begin;
+    const char* finish;
+    if (!scene_token(tok, begin, finish)){
+        scene_error(tok, "missing number");
+    }
+    //Always '.' as the decimal point, whatever locale the host application has set
+    static locale_t c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+    char* parsed;
+    double value = strtod_l(begin, &parsed, c_locale);
+    if (parsed != finish){
+        scene_error(tok, "not a number");
+    }
+    return value;
+}
+
+bool scene_keyword(const char* begin, const char* finish, const char* keyword){
+    size_t length = strlen(keyword);
+    return finish - begin == length && memcmp(begin, keyword, length) == 0;
+}
+
+//Scene format, one statement per line, '#' comments:
+//  g <acceleration>                      dt <step>            damping <factor>
+//  spring_constant <k>                   ground <stiffness>
+//  material <name> <k> <max_strain> <amplitude> <phase>
+//  mass <x> <y> <z> [mass]               masses are numbered from 0 in the order they appear
+//  spring <m0> <m1> [material]           rests at the distance of its masses, actuated if its material is
+void load_scene(const char* filename, vector<PointMass> &masses, vector<Spring> &springs){
+    string contents = get_file_contents(filename);
+    SceneTokenizer tok = {contents.data(), contents.data() + contents.size(), 1};
+    vector<pair<string, Material>> materials;
+    masses.clear();
+    springs.clear();
+    breathing_springs.clear();
+    
+    while (tok.at < tok.end){
+        const char* begin;
+        const char* finish;
+        if (scene_token(tok, begin, finish)){
+            if (scene_keyword(begin, finish, "g")){
+                g = scene_number(tok);
+            }
+            else if (scene_keyword(begin, finish, "dt")){
+                dt = (float)scene_number(tok);
+            }
+            else if (scene_keyword(begin, finish, "damping")){
+                b = scene_number(tok);
+            }
+            else if (scene_keyword(begin, finish, "spring_constant")){
+                spring_constant = (float)scene_number(tok);
+            }
+            else if (scene_keyword(begin, finish, "ground")){
+                ground_stiffness = (float)scene_number(tok);
+                obstacle_stiffness = ground_stiffness;
+            }
+            else if (scene_keyword(begin, finish, "material")){
+                if (!scene_token(tok, begin, finish)){
+                    scene_error(tok, "missing material name");
+                }
+                Material material;
+                material.k = (float)scene_number(tok);
+                material.max_strain = (float)scene_number(tok);
+                material.amplitude = (float)scene_number(tok);
+                material.phase = (float)scene_number(tok);
+                materials.push_back({string(begin, finish), material});
+            }
+            else if (scene_keyword(begin, finish, "mass")){
+                PointMass mass;
+                float x = (float)scene_number(tok);
+                float y = (float)scene_number(tok);
+                float z = (float)scene_number(tok);
+                SceneTokenizer optional = tok;
+                mass.mass = scene_token(optional, begin, finish) ? scene_number(tok) : lattice_mass;
+                mass.position = {x, y, z};
+                mass.velocity = {0.0f, 0.0f, 0.0f};
+                mass.acceleration = {0.0f, 0.0f, 0.0f};
+                mass.forces = {0.0f, 0.0f, 0.0f};
+                masses.push_back(mass);
+            }
+            else if (scene_keyword(begin, finish, "spring")){
+                double m0 = scene_number(tok);
+                double m1 = scene_number(tok);
+                if (m0 != (int)m0 || m1 != (int)m1 || m0 < 0 || m1 < 0 || m0 >= masses.size() || m1 >= masses.size()){
+                    scene_error(tok, "spring between masses that are not defined yet");
+                }
+                Spring spring;
+                spring.m0 = (int)m0;
+                spring.m1 = (int)m1;
+                spring.L0 = sqrt(pow(masses[spring.m0].position[0] - masses[spring.m1].position[0], 2) + pow(masses[spring.m0].position[1] - masses[spring.m1].position[1], 2) + pow(masses[spring.m0].position[2] - masses[spring.m1].position[2], 2));
+                if (!(spring.L0 > 0)){
+                    scene_error(tok, "spring of zero length, its direction is undefined"); //update_forces divides by the length
+                }
+                spring.L = spring.L0;
+                spring.original_L0 = spring.L0;
+                spring.k = spring_constant;
+                spring.amplitude = 0.0f;
+                if (scene_token(tok, begin, finish)){
+                    int found = -1;
+                    for (int m=0; m<materials.size() && found < 0; m++){
+                        if (scene_keyword(begin, finish, materials[m].first.c_str())){
+                            found = m;
+                        }
+                    }
+                    if (found < 0){
+                        scene_error(tok, "unknown material");
+                    }
+                    Material &material = materials[found].second;
+                    spring.k = material.k;
+                    spring.max_strain = material.max_strain;
+                    spring.amplitude = material.amplitude;
+                    spring.phase = material.phase;
+                }
+                if (spring.amplitude != 0.0f){
+                    breathing_springs.push_back((int)springs.size());
+                }
+                springs.push_back(spring);
+            }
+            else{
+                scene_error(tok, "unknown statement");
+            }
+            if (scene_token(tok, begin, finish)){
+                scene_error(tok, "unexpected value at the end of the statement");
+            }
+        }
+        if (tok.at < tok.end){
+            tok.at++; //the newline
+            tok.line++;
+        }
+    }
+}
+
+//Point cloud, one mass of lattice_mass per "x y z" line, '#' comments, parsed like a scene
+void load_cloud(const char* filename, vector<PointMass> &masses){
+    string contents = get_file_contents(filename);
+    SceneTokenizer tok = {contents.data(), contents.data() + contents.size(), 1};
+    masses.clear();
+    
+    while (tok.at < tok.end){
+        SceneTokenizer peek = tok;
+        const char* begin;
+        const char* finish;
+        if (scene_token(peek, begin, finish)){
+            PointMass mass;
+            float x = (float)scene_number(tok);
+            float y = (float)scene_number(tok);
+            float z = (float)scene_number(tok);
+            if (scene_token(tok, begin, finish)){
+                scene_error(tok, "a point is three coordinates");
+            }
+            mass.mass = lattice_mass;
+            mass.position = {x, y, z};
+            mass.velocity = {0.0f, 0.0f, 0.0f};
+            mass.acceleration = {0.0f, 0.0f, 0.0f};
+            mass.forces = {0.0f, 0.0f, 0.0f};
+            masses.push_back(mass);
+        }
+        else{
+            tok = peek; //blank or comment line
+        }
+        if (tok.at < tok.end){
+            tok.at++; //the newline
+            tok.line++;
+        }
+    }
+}
+
+//Mass and spring records, everything the step kernels read or carry from one step to the next
+//(the potential and kinetic vectors are never filled, so they are not stored)
+const size_t mass_record = sizeof(double) + 12*sizeof(float) + 3*sizeof(int32_t);
+const size_t spring_record = 7*sizeof(float) + 2*sizeof(int32_t) + 1;
+
+void pack_state(vector<char> &buffer, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int iterations){
+    //Sizes first so the buffer is filled in one sequential pass without reallocating
+    //-------------------------------------
+    vector<vector<int>*> pool_arrays = {&mass_pool.slot, &mass_pool.generation, &mass_pool.id_of_slot, &mass_pool.free_ids,
+                                        &spring_pool.slot, &spring_pool.generation, &spring_pool.id_of_slot, &spring_pool.free_ids};
+    size_t size = sizeof(CheckpointHeader) + masses.size()*mass_record + springs.size()*spring_record + bodies.size()*sizeof(Body)
+        + breathing_springs.size()*sizeof(int32_t) + 2*model.q.size()*sizeof(float);
+    for (vector<int>* array : pool_arrays){
+        size += sizeof(uint32_t) + array->size()*sizeof(int32_t);
+    }
+    buffer.resize(size);
+    char* at = buffer.data();
+    auto put = [&](const void* data, size_t length){
+        memcpy(at, data, length);
+        at += length;
+    };
+    //-------------------------------------
+    
+    CheckpointHeader header = {};
+    memcpy(header.magic, "PSSTATE", 7);
+    header.version = checkpoint_version;
+    header.num_masses = (uint32_t)masses.size();
+    header.num_springs = (uint32_t)springs.size();
+    header.num_bodies = (uint32_t)bodies.size();
+    header.num_actuated = (uint32_t)breathing_springs.size();
+    header.num_modes = (uint32_t)model.q.size();
+    header.iterations = iterations;
+    header.T = T;
+    header.dt = dt;
+    header.calm_checks = detector.calm_checks;
+    header.settled = detector.settled;
+    header.damped = damped;
+    put(&header, sizeof(header));
+    
+    for (PointMass &mass : masses){
+        put(&mass.mass, sizeof(double));
+        put(mass.position.data(), 3*sizeof(float));
+        put(mass.velocity.data(), 3*sizeof(float));
+        put(mass.acceleration.data(), 3*sizeof(float));
+        put(mass.forces.data(), 3*sizeof(float));
+        int32_t indices[3] = {mass.last_obstacle, mass.last_triangle, mass.cluster};
+        put(indices, sizeof(indices));
+    }
+    for (Spring &spring : springs){
+        float values[7] = {spring.L0, spring.L, spring.k, spring.original_L0, spring.max_strain, spring.amplitude, spring.phase};
+        int32_t ends[2] = {spring.m0, spring.m1};
+        char rigid = spring.rigid;
+        put(values, sizeof(values));
+        put(ends, sizeof(ends));
+        put(&rigid, 1);
+    }
+    put(bodies.data(), bodies.size()*sizeof(Body));
+    put(breathing_springs.data(), breathing_springs.size()*sizeof(int32_t));
+    for (vector<int>* array : pool_arrays){
+        uint32_t count = (uint32_t)array->size();
+        put(&count, sizeof(count));
+        put(array->data(), count*sizeof(int32_t));
+    }
+    put(model.q.data(), model.q.size()*sizeof(float));
+    put(model.q_dot.data(), model.q_dot.size()*sizeof(float));
+}
+
+void unpack_state(const char* buffer, size_t size, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int &iterations){
+    const char* at = buffer;
+    const char* end = buffer + size;
+    auto get = [&](void* data, size_t length){
+        if (length > (size_t)(end - at)){
+            throw(EINVAL); //truncated
+        }
+        memcpy(data, at, length);
+        at += length;
+    };
+    
+    CheckpointHeader header;
+    get(&header, sizeof(header));
+    if (memcmp(header.magic, "PSSTATE\0", 8) != 0 || header.version != checkpoint_version){
+        throw(EINVAL);
+    }
+    if (header.num_modes != model.q.size()){
+        throw(EINVAL); //the modes are rebuilt from the body, only their coordinates are restored
+    }
+    
+    masses.resize(header.num_masses);
+    for (PointMass &mass : masses){
+        float values[12];
+        int32_t indices[3];
+        get(&mass.mass, sizeof(double));
+        get(values, sizeof(values));
+        get(indices, sizeof(indices));
+        mass.position.assign(values, values + 3);
+        mass.velocity.assign(values + 3, values + 6);
+        mass.acceleration.assign(values + 6, values + 9);
+        mass.forces.assign(values + 9, values + 12);
+        mass.last_obstacle = indices[0];
+        mass.last_triangle = indices[1];
+        mass.cluster = indices[2];
+    }
+    springs.resize(header.num_springs);
+    for (Spring &spring : springs){
+        float values[7];
+        int32_t ends[2];
+        char rigid;
+        get(values, sizeof(values));
+        get(ends, sizeof(ends));
+        get(&rigid, 1);
+        spring.L0 = values[0];
+        spring.L = values[1];
+        spring.k = values[2];
+        spring.original_L0 = values[3];
+        spring.max_strain = values[4];
+        spring.amplitude = values[5];
+        spring.phase = values[6];
+        spring.m0 = ends[0];
+        spring.m1 = ends[1];
+        spring.rigid = rigid;
+    }
+    bodies.resize(header.num_bodies);
+    get(bodies.data(), bodies.size()*sizeof(Body));
+    breathing_springs.resize(header.num_actuated);
+    get(breathing_springs.data(), breathing_springs.size()*sizeof(int32_t));
+    for (vector<int>* array : {&mass_pool.slot, &mass_pool.generation, &mass_pool.id_of_slot, &mass_pool.free_ids,
+                               &spring_pool.slot, &spring_pool.generation, &spring_pool.id_of_slot, &spring_pool.free_ids}){
+        uint32_t count;
+        get(&count, sizeof(count));
+        if (count > (size_t)(end - at)/sizeof(int32_t)){
+            throw(EINVAL);
+        }
+        array->resize(count);
+        get(array->data(), count*sizeof(int32_t));
+    }
+    get(model.q.data(), model.q.size()*sizeof(float));
+    get(model.q_dot.data(), model.q_dot.size()*sizeof(float));
+    
+    iterations = header.iterations;
+    T = header.T;
+    dt = header.dt;
+    detector.calm_checks = header.calm_checks;
+    detector.settled = header.settled;
+    damped = header.damped;
+}
+
+void save_checkpoint(const char* filename, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int iterations){
+    vector<char> buffer;
+    pack_state(buffer, masses, springs, bodies, model, detector, iterations);
+    FILE* out = fopen(filename, "wb");
+    if (!out){
+        throw(errno);
+    }
+    size_t written = fwrite(buffer.data(), 1, buffer.size(), out);
+    fclose(out);
+    if (written != buffer.size()){
+        throw(EIO);
+    }
+}
+
+void load_checkpoint(const char* filename, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int &iterations){
+    string contents = get_file_contents(filename);
+    unpack_state(contents.data(), contents.size(), masses, springs, bodies, model, detector, iterations);
+}
+
+//One explicit step of the spring bodies without drawing, the same order as the render loop in main, including its
+//settle phase, which is checked every 10 iterations
+void step_headless(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Obstacle> &obstacles, SettleDetector &detector, int &iterations){
+    settle_phase(detector, springs, bodies);
+    update_forces(masses, springs, bodies, obstacles);
+    update_pos_vel_acc(masses, bodies);
+    if (sleeping){
+        update_sleep(masses, bodies);
+    }
+    T = T + dt;
+    reset_forces(masses, bodies);
+    
+    if (iterations % 10 == 0 && !detector.settled){
+        check_settle(detector, masses, bodies);
+    }
+    iterations += 1;
+}
+
+//Block-copies a state captured with pack_state into the arrays, which keep their storage from the previous fork,
+//then switches the actuation over to the controller
+void restore_fork(const vector<char> &snapshot, Controller &controller, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, ModalModel &model, SettleDetector &detector, int &iterations){
+    unpack_state(snapshot.data(), snapshot.size(), masses, springs, bodies, model, detector, iterations);
+    if (controller.amplitude.size() != breathing_springs.size() || controller.phase.size() != breathing_springs.size()){
+        throw(EINVAL);
+    }
+    for (int a=0; a<breathing_springs.size(); a++){
+        if (breathing_springs[a] < 0){
+            continue;
+        }
+        Spring &spring = springs[breathing_springs[a]];
+        spring.amplitude = controller.amplitude[a];
+        spring.phase = controller.phase[a];
+    }
+    for (Body &body : bodies){
+        wake_body(body);
+    }
+}
+
+//Runs every controller for `steps` steps from the captured state, each in a child process that shares the
+//parent's pages copy-on-write, and returns how far each moved the centre of mass over the ground.
+//The snapshot must come from spring bodies without rigid clusters or modes
+vector<float> evaluate_forks(const vector<char> &snapshot, vector<Controller> &controllers, int steps){
+    if (writer_threads > 0){
+        //a child would inherit the writers' files and sockets half-written and keep subscribers connected
+        cout << "Close the trajectory, export, telemetry and stream writers before forking" << endl;
+        throw(EBUSY);
+    }
+    int count = (int)controllers.size();
+    vector<float> distances(count, NAN);
+    int parallel = max(1, (int)thread::hardware_concurrency());
+    vector<pid_t> children(count, -1);
+    vector<int> pipes(count, -1);
+    int running = 0;
+    
+    //Waits for whichever child reports first through its pipe (or closes it by dying), so one slow controller does
+    //not hold up the free slots, then reaps that child by its pid so other children of the process are left alone
+    auto collect = [&](){
+        vector<pollfd> waiting;
+        for (int c=0; c<count; c++){
+            if (children[c] >= 0){
+                waiting.push_back({pipes[c], POLLIN, 0});
+            }
+        }
+        if (poll(waiting.data(), waiting.size(), -1) < 0){
+            return errno == EINTR ? 0 : errno;
+        }
+        for (int c=0; c<count; c++){
+            if (children[c] < 0){
+                continue;
+            }
+            bool ready = false;
+            for (pollfd &entry : waiting){
+                ready = ready || (entry.fd == pipes[c] && entry.revents != 0);
+            }
+            if (!ready){
+                continue;
+            }
+            float distance = NAN;
+            if (read(pipes[c], &distance, sizeof(distance)) == sizeof(distance)){
+                distances[c] = distance;
+            }
+            close(pipes[c]);
+            while (waitpid(children[c], nullptr, 0) < 0 && errno == EINTR){
+            }
+            children[c] = -1;
+            running--;
+        }
+        return 0;
+    };
+    auto abandon = [&](int error){
+        while (running > 0 && collect() == 0){
+        }
+        for (int c=0; c<count; c++){
+            if (children[c] >= 0){
+                close(pipes[c]);
+            }
+        }
+        throw(error);
+    };
+    
+    for (int c=0; c<count; c++){
+        while (running >= parallel){
+            int error = collect();
+            if (error){
+                abandon(error);
+            }
+        }
+        int ends[2];
+        if (pipe(ends) != 0){
+            abandon(errno);
+        }
+        fflush(stdout);
+        pid_t child = fork();
+        if (child < 0){
+            int error = errno;
+            close(ends[0]);
+            close(ends[1]);
+            abandon(error);
+        }
+        if (child == 0){
+            //Child: its own copy of the state, one controller, the result back through the pipe
+            //-------------------------------------
+            close(ends[0]);
+            vector<PointMass> masses;
+            vector<Spring> springs;
+            vector<Body> bodies;
+            ModalModel model;
+            vector<Obstacle> obstacles;
+            SettleDetector detector;
+            int iterations;
+            float distance = NAN;
+            try{
+                restore_fork(snapshot, controllers[c], masses, springs, bodies, model, detector, iterations);
+                auto centre = [&](float xy[2]){
+                    double total = 0;
+                    xy[0] = xy[1] = 0;
+                    for (Body &body : bodies){
+                        for (int i=body.first_mass; i<body.first_mass + body.num_masses; i++){
+                            xy[0] += masses[i].mass*masses[i].position[0];
+                            xy[1] += masses[i].mass*masses[i].position[1];
+                            total += masses[i].mass;
+                        }
+                    }
+                    xy[0] /= total;
+                    xy[1] /= total;
+                };
+                float start[2], finish[2];
+                centre(start);
+                for (int step=0; step<steps; step++){
+                    step_headless(masses, springs, bodies, obstacles, detector, iterations);
+                }
+                centre(finish);
+                distance = sqrt(pow(finish[0] - start[0], 2) + pow(finish[1] - start[1], 2));
+            }
+            catch (int){
+            }
+            ssize_t written = write(ends[1], &distance, sizeof(distance));
+            _exit(written == sizeof(distance) ? 0 : 1);
+            //-------------------------------------
+        }
+        close(ends[1]);
+        children[c] = child;
+        pipes[c] = ends[0];
+        running++;
+    }
+    while (running > 0){
+        int error = collect();
+        if (error){
+            abandon(error);
+        }
+    }
+    return distances;
+}
+
+//Feeds one check of the total kinetic energy and the fastest mass, true once the system has been calm
+//for settle_checks checks in a row
+bool update_settle(SettleDetector &detector, float kinetic, float max_speed){
+    if (kinetic < settle_energy && max_speed < settle_velocity){
+        detector.calm_checks += 1;
+    }
+    else{
+        detector.calm_checks = 0;
+    }
+    if (detector.calm_checks >= settle_checks){
+        detector.settled = true;
+    }
+    return detector.settled;
+}
+
+//Kinetic energy and fastest mass of the bodies, fed to update_settle
+bool check_settle(SettleDetector &detector, vector<PointMass> &masses, vector<Body> &bodies){
+    float kinetic = 0;
+    float max_speed_2 = 0;
+    for (Body &body : bodies){
+        for (int i=body.first_mass; i<body.first_mass + body.num_masses; i++){
+            float speed_2 = pow(masses[i].velocity[0], 2) + pow(masses[i].velocity[1], 2) + pow(masses[i].velocity[2], 2);
+            kinetic += 0.5 * masses[i].mass * speed_2;
+            max_speed_2 = max(max_speed_2, speed_2);
+        }
+    }
+    return update_settle(detector, kinetic, sqrt(max_speed_2));
+}
+
+//Settle phase of every run, the render loop and the headless steps go through it before each step: damped until the
+//detector reports the bodies at rest, then undamped and, with breathing on, actuated
+void settle_phase(SettleDetector &detector, vector<Spring> &springs, vector<Body> &bodies){
+    damped = !detector.settled;
+    if (breathing && detector.settled){
+        update_breathing(springs, bodies);
+    }
+}
+
+//Headless steps until the detector reports the bodies at rest or max_steps have passed, returns the steps taken.
+//The damping only changes how soon the rest pose is reached, not the pose
+int settle(vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies, vector<Obstacle> &obstacles, SettleDetector &detector, int &iterations, int max_steps){
+    int step = 0;
+    while (step < max_steps && !detector.settled){
+        step_headless(masses, springs, bodies, obstacles, detector, iterations);
+        step += 1;
+    }
+    return step;
+}
+
+//Energy of the springs, gravity and the ground at positions x, and its gradient (minus the forces) if asked for
+double rest_energy(vector<PointMass> &masses, vector<Spring> &springs, vector<double> &x, vector<double>* gradient){
+    double energy = 0;
+    if (gradient){
+        fill(gradient->begin(), gradient->end(), 0.0);
+    }
+    for (Spring &spring : springs){
+        double d[3];
+        for (int n=0; n<3; n++){
+            d[n] = x[3*spring.m1 + n] - x[3*spring.m0 + n];
+        }
+        double L = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        double stretch = L - spring.L0;
+        energy += 0.5*spring.k*stretch*stretch;
+        if (gradient && L > 0){
+            for (int n=0; n<3; n++){
+                double f = spring.k*stretch*d[n]/L;
+                (*gradient)[3*spring.m1 + n] += f;
+                (*gradient)[3*spring.m0 + n] -= f;
+            }
+        }
+    }
+    for (int i=0; i<masses.size(); i++){
+        double z = x[3*i + 2];
+        energy -= masses[i].mass*g*z;
+        if (z < 0){
+            energy += 0.5*ground_stiffness*z*z;
+        }
+        if (gradient){
+            (*gradient)[3*i + 2] += -masses[i].mass*g + (z < 0 ? ground_stiffness*z : 0.0);
+        }
+    }
+    return energy;
+}
+
+//Newton's method on the energy of the spring network under gravity and ground contact, started with the body
+//lowered onto the ground. Returns the Newton iterations taken, the masses are left at rest in the pose found.
+//converged is false if the residual tolerance was not reached, then the pose is the last iterate that lowered the energy.
+//Tetrahedra, obstacles and rigid clusters are not part of the energy
+int solve_rest_pose(vector<PointMass> &masses, vector<Spring> &springs, bool &converged){
+    int num_masses = (int)masses.size();
+    int N = 3*num_masses;
+    converged = true;
+    if (num_masses == 0){
+        return 0;
+    }
+    vector<double> x(N);
+    double lowest = INFINITY;
+    for (int i=0; i<num_masses; i++){
+        for (int n=0; n<3; n++){
+            x[3*i + n] = masses[i].position[n];
+        }
+        lowest = min(lowest, x[3*i + 2]);
+    }
+    for (int i=0; i<num_masses; i++){
+        x[3*i + 2] -= lowest;
+    }
+    
+    //The floating modes (sliding and turning on the ground) have no stiffness, a small shift keeps CG away from them
+    double shift = 0;
+    for (Spring &spring : springs){
+        shift += spring.k;
+    }
+    shift = 1e-8*(shift + ground_stiffness)/num_masses;
+    
+    vector<double> gradient(N), step(N), r(N), p(N), Hp(N), trial(N);
+    int iteration = 0;
+    for (; iteration<newton_iterations; iteration++){
+        double energy = rest_energy(masses, springs, x, &gradient);
+        double largest = 0;
+        for (int n=0; n<N; n++){
+            largest = max(largest, fabs(gradient[n]));
+        }
+        if (largest < rest_tolerance){
+            break;
+        }
+        
+        //Newton step H step = -gradient by CG on the tangent stiffness, stopped at the first direction of
+        //negative curvature (springs in compression), which falls back to steepest descent on the first iteration
+        //-------------------------------------
+        fill(step.begin(), step.end(), 0.0);
+        for (int n=0; n<N; n++){
+            r[n] = -gradient[n];
+        }
+        p = r;
+        double rr = inner_product(r.begin(), r.end(), r.begin(), 0.0);
+        double stop = 1e-12*rr;
+        for (int it=0; it<4*N && rr > stop; it++){
+            spring_stiffness_product(springs, x, p, Hp);
+            for (int i=0; i<num_masses; i++){
+                if (x[3*i + 2] < 0){
+                    Hp[3*i + 2] += ground_stiffness*p[3*i + 2];
+                }
+            }
+            for (int n=0; n<N; n++){
+                Hp[n] += shift*p[n];
+            }
+            double pHp = inner_product(p.begin(), p.end(), Hp.begin(), 0.0);
+            if (pHp <= 0){
+                if (it == 0){
+                    step = r;
+                }
+                break;
+            }
+            double alpha = rr/pHp;
+            for (int n=0; n<N; n++){
+                step[n] += alpha*p[n];
+                r[n] -= alpha*Hp[n];
+            }
+            double rr_new = inner_product(r.begin(), r.end(), r.begin(), 0.0);
+            for (int n=0; n<N; n++){
+                p[n] = r[n] + (rr_new/rr)*p[n];
+            }
+            rr = rr_new;
+        }
+        //-------------------------------------
+        
+        //Backtracking line search on the energy (Armijo condition), stuck if no step lowers it
+        //-------------------------------------
+        double slope = inner_product(gradient.begin(), gradient.end(), step.begin(), 0.0);
+        double alpha = 1.0;
+        bool accepted = false;
+        for (int halving=0; halving<30 && !accepted; halving++){
+            for (int n=0; n<N; n++){
+                trial[n] = x[n] + alpha*step[n];
+            }
+            accepted = rest_energy(masses, springs, trial, nullptr) <= energy + 1e-4*alpha*slope;
+            alpha *= 0.5;
+        }
+        if (!accepted){
+            break;
+        }
+        x = trial;
+        //-------------------------------------
+    }
+    
+    //Converged only if the pose that is kept meets the tolerance, whether the loop ran out, stalled or stopped early
+    rest_energy(masses, springs, x, &gradient);
+    double largest = 0;
+    for (int n=0; n<N; n++){
+        largest = max(largest, fabs(gradient[n]));
+    }
+    converged = largest < rest_tolerance;
+    
+    for (int i=0; i<num_masses; i++){
+        for (int n=0; n<3; n++){
+            masses[i].position[n] = (float)x[3*i + n];
+        }
+        masses[i].velocity = {0.0f, 0.0f, 0.0f};
+        masses[i].acceleration = {0.0f, 0.0f, 0.0f};
+        masses[i].forces = {0.0f, 0.0f, 0.0f};
+    }
+    for (Spring &spring : springs){
+        spring.L = sqrt(pow(masses[spring.m0].position[0] - masses[spring.m1].position[0], 2) + pow(masses[spring.m0].position[1] - masses[spring.m1].position[1], 2) + pow(masses[spring.m0].position[2] - masses[spring.m1].position[2], 2));
+    }
+    return iteration;
+}
+
+//Next free slot for the producer to fill, nullptr while the ring is full
+template <typename T>
+T* ring_claim(Ring<T> &ring){
+    size_t head = ring.head.load(memory_order_relaxed);
+    if (head - ring.tail.load(memory_order_acquire) == ring.slots.size()){
+        return nullptr;
+    }
+    return &ring.slots[head % ring.slots.size()];
+}
+
+template <typename T>
+void ring_publish(Ring<T> &ring){
+    ring.head.store(ring.head.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+//Oldest published slot for the consumer, nullptr while the ring is empty
+template <typename T>
+T* ring_front(Ring<T> &ring){
+    size_t tail = ring.tail.load(memory_order_relaxed);
+    if (tail == ring.head.load(memory_order_acquire)){
+        return nullptr;
+    }
+    return &ring.slots[tail % ring.slots.size()];
+}
+
+template <typename T>
+void ring_release(Ring<T> &ring){
+    ring.tail.store(ring.tail.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+//Byte offsets of the columns inside a trajectory frame whose positions column takes positions_size bytes
+void trajectory_layout(TrajectoryHeader &header, uint64_t positions_size, uint64_t column_offset[3], uint64_t &frame_size){
+    uint64_t sizes[3] = {
+        positions_size,
+        (header.columns & 1) ? sizeof(float)*3*header.num_masses : 0,
+        (header.columns & 2) ? sizeof(float)*header.num_springs : 0
+    };
+    uint64_t end = 64; //T
+    for (int c=0; c<3; c++){
+        column_offset[c] = end;
+        end = (end + sizes[c] + 63)/64*64;
+    }
+    frame_size = end;
+}
+
+void open_trajectory(TrajectoryRecorder &recorder, const char* filename, int num_masses, int num_springs, bool velocities, bool lengths, int stride, float tolerance){
+    recorder.file = fopen(filename, "wb");
+    if (!recorder.file){
+        throw(errno);
+    }
+    setvbuf(recorder.file, nullptr, _IOFBF, 1 << 22); //large sequential appends
+    
+    TrajectoryHeader &header = recorder.header;
+    header = {};
+    memcpy(header.magic, "PSTRAJ", 6);
+    header.version = trajectory_version;
+    header.num_masses = num_masses;
+    header.num_springs = num_springs;
+    header.columns = (velocities ? 1 : 0) | (lengths ? 2 : 0);
+    header.stride = max(1, stride);
+    recorder.masses.resize(num_masses);
+    for (int i=0; i<num_masses; i++){
+        recorder.masses[i] = pool_handle(mass_pool, i);
+    }
+    recorder.springs.resize(num_springs);
+    for (int i=0; i<num_springs; i++){
+        recorder.springs[i] = pool_handle(spring_pool, i);
+    }
+    uint64_t column_offset[3];
+    uint64_t raw_frame_size;
+    trajectory_layout(header, sizeof(float)*3*num_masses, column_offset, raw_frame_size);
+    header.frame_size = raw_frame_size;
+    if (tolerance > 0){
+        header.columns |= 4;
+        header.frame_size = 0;
+        header.keyframe_interval = max(1, trajectory_keyframe_interval);
+        header.quantum = 2.0*tolerance;
+        recorder.codec = TrajectoryCodec();
+        recorder.codec.quantum = header.quantum;
+        recorder.codec.keyframe_interval = header.keyframe_interval;
+        recorder.encoded.assign(raw_frame_size + 24 + (3*num_masses/64 + 1)*(1 + 64*8), 0); //worst case of encode_positions
+    }
+    fwrite(&header, sizeof(header), 1, recorder.file);
+    
+    //Frames start 64-byte aligned, the padding after the header is written once here
+    char zeros[64] = {};
+    recorder.offset = (sizeof(header) + 63)/64*64;
+    fwrite(zeros, 1, recorder.offset - sizeof(header), recorder.file);
+    
+    recorder.ring.slots.assign(trajectory_frames_in_flight, vector<char>(raw_frame_size, 0));
+    recorder.index.clear();
+    recorder.step = 0;
+    recorder.closing = false;
+    recorder.writer = thread([&recorder](){
+        while (true){
+            vector<char>* frame = ring_front(recorder.ring);
+            if (!frame){
+                if (recorder.closing.load(memory_order_acquire) && !ring_front(recorder.ring)){
+                    break;
+                }
+                this_thread::sleep_for(chrono::milliseconds(1));
+                continue;
+            }
+            TrajectoryIndexEntry entry;
+            memcpy(&entry.T, frame->data(), sizeof(float));
+            entry.offset = recorder.offset;
+            if (recorder.header.columns & 4){
+                write_quantized_frame(recorder, *frame);
+            }
+            else {
+                fwrite(frame->data(), 1, frame->size(), recorder.file);
+                recorder.offset += frame->size();
+            }
+            entry.size = (uint32_t)(recorder.offset - entry.offset);
+            recorder.index.push_back(entry);
+            ring_release(recorder.ring);
+        }
+    });
+    writer_threads++;
+}
+
+//Copies this step's state into a preallocated frame every stride steps. Waits for the writer only when
+//trajectory_frames_in_flight frames are already queued, so no frame is dropped
+void record_frame(TrajectoryRecorder &recorder, vector<PointMass> &masses, vector<Spring> &springs){
+    TrajectoryHeader &header = recorder.header;
+    if (recorder.step++ % header.stride != 0){
+        return;
+    }
+    vector<char>* frame;
+    while (!(frame = ring_claim(recorder.ring))){
+        this_thread::yield();
+    }
+    uint64_t column_offset[3], frame_size;
+    trajectory_layout(header, sizeof(float)*3*header.num_masses, column_offset, frame_size);
+    memcpy(frame->data(), &T, sizeof(float));
+    
+    //Columns follow the masses and springs that were in their slots when the recorder was opened, wherever compaction
+    //or swap-removal has moved them since. One created later is not recorded, a removed one is recorded as 0
+    float* positions = (float*)(frame->data() + column_offset[0]);
+    float* velocities = (float*)(frame->data() + column_offset[1]);
+    float* lengths = (float*)(frame->data() + column_offset[2]);
+    for (int i=0; i<header.num_masses; i++){
+        int slot = pool_slot(mass_pool, recorder.masses[i]);
+        for (int n=0; n<3; n++){
+            positions[3*i + n] = slot >= 0 ? masses[slot].position[n] : 0.0f;
+        }
+    }
+    if (header.columns & 1){
+        for (int i=0; i<header.num_masses; i++){
+            int slot = pool_slot(mass_pool, recorder.masses[i]);
+            for (int n=0; n<3; n++){
+                velocities[3*i + n] = slot >= 0 ? masses[slot].velocity[n] : 0.0f;
+            }
+        }
+    }
+    if (header.columns & 2){
+        for (int i=0; i<header.num_springs; i++){
+            int slot = pool_slot(spring_pool, recorder.springs[i]);
+            lengths[i] = slot >= 0 ? springs[slot].L : 0.0f;
+        }
+    }
+    ring_publish(recorder.ring);
+}
+
+//Bit-packs values in blocks of 64, each block one width byte followed by its values at that width
+char* pack_blocks(const uint64_t* values, int count, char* out){
+    for (int first=0; first<count; first+=64){
+        int last = min(count, first + 64);
+        uint64_t any = 0;
+        for (int i=first; i<last; i++){
+            any |= values[i];
+        }
+        int width = 0;
+        while (width < 64 && (any >> width) != 0){
+            width++;
+        }
+        *out++ = (char)width;
+        uint64_t bits = 0;
+        int filled = 0;
+        for (int i=first; i<last; i++){
+            uint64_t value = values[i];
+            for (int left=width; left>0; ){
+                int chunk = min(left, 32);
+                bits |= (value & ((1ull << chunk) - 1)) << filled;
+                filled += chunk;
+                value >>= chunk;
+                left -= chunk;
+                while (filled >= 8){
+                    *out++ = (char)bits;
+                    bits >>= 8;
+                    filled -= 8;
+                }
+            }
+        }
+        if (filled > 0){
+            *out++ = (char)bits;
+        }
+    }
+    return out;
+}
+
+const char* unpack_blocks(const char* in, int count, uint64_t* values){
+    for (int first=0; first<count; first+=64){
+        int last = min(count, first + 64);
+        int width = (unsigned char)*in++;
+        uint64_t bits = 0;
+        int filled = 0;
+        for (int i=first; i<last; i++){
+            uint64_t value = 0;
+            for (int done=0; done<width; ){
+                int chunk = min(width - done, 32);
+                while (filled < chunk){
+                    bits |= (uint64_t)(unsigned char)*in++ << filled;
+                    filled += 8;
+                }
+                value |= (bits & ((1ull << chunk) - 1)) << done;
+                bits >>= chunk;
+                filled -= chunk;
+                done += chunk;
+            }
+            values[i] = value;
+        }
+    }
+    return in;
+}
+
+//Writes the positions of the next frame to out and returns the bytes written, at most
+//24 + (3*num_masses/64 + 1)*(1 + 64*8). Every decoded coordinate is within quantum/2 of the original
+size_t encode_positions(TrajectoryCodec &codec, const float* positions, int num_masses, char* out){
+    int count = 3*num_masses;
+    bool keyframe = codec.frames % codec.keyframe_interval == 0;
+    codec.current.resize(count);
+    codec.residuals.resize(count);
+    int64_t* q = codec.current.data();
+    double inverse = 1.0/codec.quantum;
+    for (int axis=0; axis<3; axis++){
+        for (int i=0; i<num_masses; i++){
+            q[axis*num_masses + i] = (int64_t)floor(positions[3*i + axis]*inverse + 0.5);
+        }
+    }
+    char* start = out;
+    uint64_t* residuals = codec.residuals.data();
+    if (keyframe){
+        for (int axis=0; axis<3; axis++){
+            int64_t corner = INT64_MAX;
+            for (int i=0; i<num_masses; i++){
+                corner = min(corner, q[axis*num_masses + i]);
+            }
+            memcpy(out, &corner, sizeof(corner));
+            out += sizeof(corner);
+            for (int i=0; i<num_masses; i++){
+                residuals[axis*num_masses + i] = (uint64_t)(q[axis*num_masses + i] - corner);
+            }
+        }
+    }
+    else {
+        const int64_t* p = codec.previous.data();
+        const int64_t* pp = codec.before_previous.data();
+        bool linear = codec.frames % codec.keyframe_interval > 1; //two frames since the keyframe to extrapolate from
+        for (int i=0; i<count; i++){
+            int64_t r = q[i] - (linear ? 2*p[i] - pp[i] : p[i]);
+            residuals[i] = ((uint64_t)r << 1) ^ (uint64_t)(r >> 63); //zigzag, small magnitudes of either sign stay small
+        }
+    }
+    out = pack_blocks(residuals, count, out);
+    codec.before_previous.swap(codec.previous);
+    codec.previous.swap(codec.current);
+    codec.frames++;
+    return out - start;
+}
+
+//Reads the positions of the next frame written by encode_positions, returns the bytes read
+size_t decode_positions(TrajectoryCodec &codec, const char* in, int num_masses, float* positions){
+    int count = 3*num_masses;
+    bool keyframe = codec.frames % codec.keyframe_interval == 0;
+    codec.current.resize(count);
+    codec.residuals.resize(count);
+    int64_t* q = codec.current.data();
+    uint64_t* residuals = codec.residuals.data();
+    const char* start = in;
+    int64_t corner[3];
+    if (keyframe){
+        memcpy(corner, in, sizeof(corner));
+        in += sizeof(corner);
+    }
+    in = unpack_blocks(in, count, residuals);
+    if (keyframe){
+        for (int axis=0; axis<3; axis++){
+            for (int i=0; i<num_masses; i++){
+                q[axis*num_masses + i] = corner[axis] + (int64_t)residuals[axis*num_masses + i];
+            }
+        }
+    }
+    else {
+        const int64_t* p = codec.previous.data();
+        const int64_t* pp = codec.before_previous.data();
+        bool linear = codec.frames % codec.keyframe_interval > 1;
+        for (int i=0; i<count; i++){
+            int64_t r = (int64_t)(residuals[i] >> 1) ^ -(int64_t)(residuals[i] & 1);
+            q[i] = r + (linear ? 2*p[i] - pp[i] : p[i]);
+        }
+    }
+    for (int axis=0; axis<3; axis++){
+        for (int i=0; i<num_masses; i++){
+            positions[3*i + axis] = (float)(q[axis*num_masses + i]*codec.quantum);
+        }
+    }
+    codec.before_previous.swap(codec.previous);
+    codec.previous.swap(codec.current);
+    codec.frames++;
+    return in - start;
+}
+
+//Writer thread side of a quantized trajectory: T and the payload size, the encoded positions, then the other
+//columns copied from the raw frame
+void write_quantized_frame(TrajectoryRecorder &recorder, vector<char> &frame){
+    TrajectoryHeader &header = recorder.header;
+    uint32_t positions_size = (uint32_t)encode_positions(recorder.codec, (float*)(frame.data() + 64), header.num_masses, recorder.encoded.data());
+    uint64_t raw_offset[3], encoded_offset[3], raw_size, encoded_size;
+    trajectory_layout(header, sizeof(float)*3*header.num_masses, raw_offset, raw_size);
+    trajectory_layout(header, positions_size, encoded_offset, encoded_size);
+    
+    char zeros[64] = {};
+    memcpy(zeros, frame.data(), sizeof(float));
+    memcpy(zeros + sizeof(float), &positions_size, sizeof(uint32_t));
+    fwrite(zeros, 1, 64, recorder.file);
+    fwrite(recorder.encoded.data(), 1, positions_size, recorder.file);
+    memset(zeros, 0, 64);
+    fwrite(zeros, 1, encoded_offset[1] - 64 - positions_size, recorder.file);
+    fwrite(frame.data() + raw_offset[1], 1, raw_size - raw_offset[1], recorder.file);
+    recorder.offset += encoded_size;
+}
+
+//Drains the queued frames, appends the frame index and fills in the header
+void close_trajectory(TrajectoryRecorder &recorder){
+    if (!recorder.file){
+        return;
+    }
+    recorder.closing.store(true, memory_order_release);
+    recorder.writer.join();
+    writer_threads--;
+    TrajectoryHeader &header = recorder.header;
+    header.num_frames = recorder.index.size();
+    header.index_offset = recorder.offset;
+    fwrite(recorder.index.data(), sizeof(TrajectoryIndexEntry), recorder.index.size(), recorder.file);
+    fseek(recorder.file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, recorder.file);
+    fclose(recorder.file);
+    recorder.file = nullptr;
+}
+
+MappedTrajectory map_trajectory(const char* filename){
+    MappedTrajectory trajectory;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0){
+        throw(errno);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0){
+        int error = errno;
+        close(fd);
+        throw(error);
+    }
+    trajectory.size = (size_t)info.st_size;
+    trajectory.data = trajectory.size >= sizeof(TrajectoryHeader) ? mmap(nullptr, trajectory.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (trajectory.data == MAP_FAILED){
+        trajectory.data = nullptr;
+        throw(EINVAL);
+    }
+    trajectory.header = (TrajectoryHeader*)trajectory.data;
+    TrajectoryHeader &header = *trajectory.header;
+    bool valid = memcmp(header.magic, "PSTRAJ\0\0", 8) == 0 && header.version == trajectory_version
+        && header.index_offset <= trajectory.size
+        && header.num_frames <= (trajectory.size - header.index_offset)/sizeof(TrajectoryIndexEntry);
+    if (!valid){
+        unmap_trajectory(trajectory);
+        throw(EINVAL); //also an unfinished recording, whose index has not been written
+    }
+    trajectory.index = (TrajectoryIndexEntry*)((char*)trajectory.data + header.index_offset);
+    return trajectory;
+}
+
+//Column 0 positions, 1 velocities, 2 spring lengths of a frame, straight from the mapping, nullptr if not recorded.
+//Quantized positions are not a float column, read them with trajectory_positions
+const float* trajectory_column(MappedTrajectory &trajectory, int frame, int column){
+    TrajectoryHeader &header = *trajectory.header;
+    if (frame < 0 || frame >= header.num_frames || (column == 0 && (header.columns & 4)) || (column == 1 && !(header.columns & 1)) || (column == 2 && !(header.columns & 2))){
+        return nullptr;
+    }
+    const char* data = (char*)trajectory.data + trajectory.index[frame].offset;
+    uint32_t positions_size = sizeof(float)*3*header.num_masses;
+    if (header.columns & 4){
+        memcpy(&positions_size, data + sizeof(float), sizeof(uint32_t));
+    }
+    uint64_t column_offset[3], frame_size;
+    trajectory_layout(header, positions_size, column_offset, frame_size);
+    return (const float*)(data + column_offset[column]);
+}
+
+//Positions of a frame, float[3*num_masses]. Quantized frames are decoded from the nearest keyframe unless the
+//cursor already holds the frames before, so reading a trajectory in order decodes every frame once
+void trajectory_positions(MappedTrajectory &trajectory, TrajectoryCodec &cursor, int frame, float* positions){
+    TrajectoryHeader &header = *trajectory.header;
+    if (frame < 0 || frame >= header.num_frames){
+        throw(EINVAL);
+    }
+    if (!(header.columns & 4)){
+        memcpy(positions, trajectory_column(trajectory, frame, 0), sizeof(float)*3*header.num_masses);
+        return;
+    }
+    int keyframe = frame - frame % header.keyframe_interval;
+    int first = keyframe;
+    if (cursor.quantum == header.quantum && cursor.keyframe_interval == header.keyframe_interval && cursor.frames > keyframe && cursor.frames <= frame){
+        first = cursor.frames;
+    }
+    else {
+        cursor = TrajectoryCodec();
+        cursor.quantum = header.quantum;
+        cursor.keyframe_interval = header.keyframe_interval;
+        cursor.frames = keyframe;
+    }
+    for (int f=first; f<=frame; f++){
+        decode_positions(cursor, (char*)trajectory.data + trajectory.index[f].offset + 64, header.num_masses, positions);
+    }
+}
+
+void unmap_trajectory(MappedTrajectory &trajectory){
+    if (trajectory.data){
+        munmap(trajectory.data, trajectory.size);
+    }
+    trajectory = MappedTrajectory();
+}
+
+//Snapshot buffers are sized for num_masses and num_springs here, they only grow if the scene does
+void open_export(SequenceExporter &exporter, const char* prefix, int num_masses, int num_springs){
+    exporter.prefix = prefix;
+    ExportFrame empty;
+    empty.points.resize(3*num_masses);
+    empty.velocities.resize(3*num_masses);
+    empty.lines.resize(2*num_springs);
+    empty.strain.resize(num_springs);
+    exporter.ring.slots.assign(export_frames_in_flight, empty);
+    exporter.staging.reserve(600 + 28*num_masses + 16*num_springs);
+    exporter.step = 0;
+    exporter.frames = 0;
+    exporter.dropped = 0;
+    exporter.closing = false;
+    exporter.writer = thread([&exporter](){
+        char filename[1024];
+        while (true){
+            ExportFrame* frame = ring_front(exporter.ring);
+            if (!frame){
+                if (exporter.closing.load(memory_order_acquire) && !ring_front(exporter.ring)){
+                    break;
+                }
+                this_thread::sleep_for(chrono::milliseconds(1));
+                continue;
+            }
+            snprintf(filename, sizeof(filename), "%s_%06d.vtk", exporter.prefix, frame->number);
+            try {
+                write_vtk(filename, *frame, exporter.staging);
+            }
+            catch (int error){
+                cout << "Could not write " << filename << ": " << strerror(error) << endl;
+            }
+            ring_release(exporter.ring);
+        }
+    });
+    writer_threads++;
+}
+
+//Copies the masses and springs of every body into a free snapshot every export_stride steps. Never waits for the
+//writer: when all export_frames_in_flight snapshots are still queued the frame is dropped and counted
+void export_frame(SequenceExporter &exporter, vector<PointMass> &masses, vector<Spring> &springs, vector<Body> &bodies){
+    if (exporter.step++ % export_stride != 0){
+        return;
+    }
+    ExportFrame* frame = ring_claim(exporter.ring);
+    if (!frame){
+        exporter.dropped++;
+        return;
+    }
+    frame->T = T;
+    frame->number = exporter.frames++;
+    int num_points = 0;
+    int num_lines = 0;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        num_points += bodies[b_i].num_masses;
+        num_lines += bodies[b_i].num_springs;
+    }
+    if (frame->points.size() < 3*num_points){
+        frame->points.resize(3*num_points);
+        frame->velocities.resize(3*num_points);
+    }
+    if (frame->strain.size() < num_lines){
+        frame->lines.resize(2*num_lines);
+        frame->strain.resize(num_lines);
+    }
+    frame->num_points = num_points;
+    frame->num_lines = num_lines;
+    
+    //Spare slots between bodies are skipped, so each body's masses are shifted down by the gaps before it
+    int point = 0;
+    int line = 0;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        Body &body = bodies[b_i];
+        int shift = point - body.first_mass;
+        for (int i=body.first_mass; i<body.first_mass + body.num_masses; i++, point++){
+            memcpy(&frame->points[3*point], masses[i].position.data(), 3*sizeof(float));
+            memcpy(&frame->velocities[3*point], masses[i].velocity.data(), 3*sizeof(float));
+        }
+        for (int i=body.first_spring; i<body.first_spring + body.num_springs; i++, line++){
+            frame->lines[2*line] = springs[i].m0 + shift;
+            frame->lines[2*line + 1] = springs[i].m1 + shift;
+            //from the positions rather than springs[i].L, which the modal step never updates
+            float length = sqrt(pow(masses[springs[i].m1].position[0] - masses[springs[i].m0].position[0], 2) + pow(masses[springs[i].m1].position[1] - masses[springs[i].m0].position[1], 2) + pow(masses[springs[i].m1].position[2] - masses[springs[i].m0].position[2], 2));
+            frame->strain[line] = (length - springs[i].L0)/springs[i].L0;
+        }
+    }
+    ring_publish(exporter.ring);
+}
+
+//Appends 4-byte values in big-endian order, which the legacy VTK binary format requires
+void append_big_endian(vector<char> &out, const void* values, int count){
+    const uint32_t* words = (const uint32_t*)values;
+    size_t at = out.size();
+    out.resize(at + 4*count);
+    char* o = out.data() + at;
+    for (int i=0; i<count; i++){
+        uint32_t w = words[i];
+        o[4*i] = (char)(w >> 24);
+        o[4*i + 1] = (char)(w >> 16);
+        o[4*i + 2] = (char)(w >> 8);
+        o[4*i + 3] = (char)w;
+    }
+}
+
+void append_text(vector<char> &out, const char* text){
+    out.insert(out.end(), text, text + strlen(text));
+}
+
+//Legacy VTK polydata: the masses as points with a velocity vector each, the springs as lines with their strain
+void write_vtk(const char* filename, ExportFrame &frame, vector<char> &staging){
+    char line[256];
+    staging.clear();
+    snprintf(line, sizeof(line), "# vtk DataFile Version 3.0\nPhysicsSimulator T=%g\nBINARY\nDATASET POLYDATA\nPOINTS %d float\n", frame.T, frame.num_points);
+    append_text(staging, line);
+    append_big_endian(staging, frame.points.data(), 3*frame.num_points);
+    snprintf(line, sizeof(line), "\nLINES %d %d\n", frame.num_lines, 3*frame.num_lines);
+    append_text(staging, line);
+    for (int i=0; i<frame.num_lines; i++){
+        int cell[3] = {2, frame.lines[2*i], frame.lines[2*i + 1]};
+        append_big_endian(staging, cell, 3);
+    }
+    snprintf(line, sizeof(line), "\nCELL_DATA %d\nSCALARS strain float 1\nLOOKUP_TABLE default\n", frame.num_lines);
+    append_text(staging, line);
+    append_big_endian(staging, frame.strain.data(), frame.num_lines);
+    snprintf(line, sizeof(line), "\nPOINT_DATA %d\nVECTORS velocity float\n", frame.num_points);
+    append_text(staging, line);
+    append_big_endian(staging, frame.velocities.data(), 3*frame.num_points);
+    append_text(staging, "\n");
+    
+    FILE* file = fopen(filename, "wb");
+    if (!file){
+        throw(errno);
+    }
+    size_t written = fwrite(staging.data(), 1, staging.size(), file);
+    if (fclose(file) != 0 || written != staging.size()){
+        throw(EIO);
+    }
+}
+
+//Writes the queued snapshots and stops the writer thread
+void close_export(SequenceExporter &exporter){
+    if (!exporter.writer.joinable()){
+        return;
+    }
+    exporter.closing.store(true, memory_order_release);
+    exporter.writer.join();
+    writer_threads--;
+}
+
+//Starts the CSV file and its writer thread, which flushes every telemetry_flush_interval ms
+void open_telemetry(Telemetry &telemetry, const char* filename){
+    telemetry.file = fopen(filename, "w");
+    if (!telemetry.file){
+        throw(errno);
+    }
+    fprintf(telemetry.file, "iteration,T,potential,kinetic,total,max_speed\n");
+    telemetry.ring.slots.assign(telemetry_capacity, TelemetrySample());
+    telemetry.samples = 0;
+    telemetry.dropped = 0;
+    telemetry.closing = false;
+    telemetry.writer = thread([&telemetry](){
+        auto flushed = chrono::steady_clock::now();
+        while (true){
+            TelemetrySample* sample = ring_front(telemetry.ring);
+            if (sample){
+                fprintf(telemetry.file, "%d,%.9g,%.9g,%.9g,%.9g,%.9g\n", sample->iteration, sample->T, sample->potential, sample->kinetic, sample->total, sample->max_speed);
+                ring_release(telemetry.ring);
+            }
+            else if (telemetry.closing.load(memory_order_acquire) && !ring_front(telemetry.ring)){
+                break;
+            }
+            auto now = chrono::steady_clock::now();
+            if (now - flushed >= chrono::milliseconds(telemetry_flush_interval)){
+                fflush(telemetry.file);
+                flushed = now;
+            }
+            if (!sample){
+                this_thread::sleep_for(chrono::milliseconds(1));
+            }
+        }
+        fclose(telemetry.file);
+    });
+    writer_threads++;
+}
+
+//Called from the simulation thread, copies the sample into the ring and returns false if it was full
+bool push_sample(Telemetry &telemetry, TelemetrySample &sample){
+    TelemetrySample* slot = ring_claim(telemetry.ring);
+    if (!slot){
+        telemetry.dropped++;
+        return false;
+    }
+    *slot = sample;
+    ring_publish(telemetry.ring);
+    telemetry.samples++;
+    return true;
+}
+
+//Writes the queued samples and closes the file
+void close_telemetry(Telemetry &telemetry){
+    if (!telemetry.writer.joinable()){
+        return;
+    }
+    telemetry.closing.store(true, memory_order_release);
+    telemetry.writer.join();
+    writer_threads--;
+    telemetry.file = nullptr;
+}
+
+static_assert(atomic<uint64_t>::is_always_lock_free && atomic<uint32_t>::is_always_lock_free, "the shared state needs address-free atomics");
+
+SharedStateBuffer* shared_buffer(SharedState &shared, int which){
+    return (SharedStateBuffer*)((char*)shared.data + shared.header->buffer_offset[which]);
+}
+
+const float* shared_positions(const SharedStateBuffer* buffer){
+    return (const float*)((const char*)buffer + sizeof(SharedStateBuffer));
+}
+
+//Creates the segment with room for capacity masses, replacing any left behind by an earlier run
+void open_shared_state(SharedState &shared, const char* name, int capacity){
+    uint64_t buffer_size = sizeof(SharedStateBuffer) + (sizeof(float)*3*capacity + 63)/64*64;
+    size_t size = sizeof(SharedStateHeader) + 2*buffer_size;
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0){
+        throw(errno);
+    }
+    if (ftruncate(fd, size) != 0){
+        int error = errno;
+        close(fd);
+        shm_unlink(name);
+        throw(error);
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        shm_unlink(name);
+        throw(errno);
+    }
+    shared.name = name;
+    shared.owner = true;
+    shared.data = data;
+    shared.size = size;
+    shared.header = new (data) SharedStateHeader();
+    SharedStateHeader &header = *shared.header;
+    header.magic.store(0, memory_order_relaxed);
+    header.capacity = capacity;
+    header.current.store(0, memory_order_relaxed);
+    header.buffer_size = buffer_size;
+    for (int which=0; which<2; which++){
+        header.buffer_offset[which] = sizeof(SharedStateHeader) + which*buffer_size;
+        new (shared_buffer(shared, which)) SharedStateBuffer();
+        shared_buffer(shared, which)->sequence.store(0, memory_order_relaxed);
+    }
+    //the magic goes in last, so a reader that sees it also sees the rest of the header
+    header.magic.store(shared_state_magic, memory_order_release);
+}
+
+//Copies the masses of every body, up to the capacity, and the sample into the buffer readers are not on, then flips
+void publish_state(SharedState &shared, vector<PointMass> &masses, vector<Body> &bodies, TelemetrySample &sample){
+    SharedStateHeader &header = *shared.header;
+    int which = 1 - header.current.load(memory_order_relaxed);
+    SharedStateBuffer* buffer = shared_buffer(shared, which);
+    uint64_t sequence = buffer->sequence.load(memory_order_relaxed);
+    buffer->sequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    float* positions = (float*)shared_positions(buffer);
+    int count = 0;
+    for (int b_i=0; b_i<bodies.size(); b_i++){
+        int last = min(bodies[b_i].first_mass + bodies[b_i].num_masses, bodies[b_i].first_mass + (int)header.capacity - count);
+        for (int i=bodies[b_i].first_mass; i<last; i++, count++){
+            memcpy(positions + 3*count, masses[i].position.data(), 3*sizeof(float));
+        }
+    }
+    buffer->iteration = sample.iteration;
+    buffer->num_masses = count;
+    buffer->T = sample.T;
+    buffer->potential = sample.potential;
+    buffer->kinetic = sample.kinetic;
+    buffer->total = sample.total;
+    buffer->max_speed = sample.max_speed;
+    
+    buffer->sequence.store(sequence + 2, memory_order_release);
+    header.current.store(which, memory_order_release);
+}
+
+//Maps a segment created by another process read-only
+void map_shared_state(SharedState &shared, const char* name){
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0){
+        throw(errno);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < sizeof(SharedStateHeader)){
+        close(fd);
+        throw(EINVAL);
+    }
+    void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        throw(errno);
+    }
+    shared.name = name;
+    shared.owner = false;
+    shared.data = data;
+    shared.size = info.st_size;
+    shared.header = (SharedStateHeader*)data;
+    SharedStateHeader &header = *shared.header;
+    bool valid = header.magic.load(memory_order_acquire) == shared_state_magic;
+    valid = valid && sizeof(SharedStateHeader) + 2*header.buffer_size <= shared.size
+        && header.buffer_size >= sizeof(SharedStateBuffer) + sizeof(float)*3*header.capacity;
+    if (!valid){
+        close_shared_state(shared);
+        throw(EINVAL);
+    }
+}
+
+//Zero-copy read: returns the current buffer, which can be used in place until end_read_state says whether it
+//changed in the meantime, in which case whatever was read from it has to be discarded
+const SharedStateBuffer* begin_read_state(SharedState &shared, uint64_t &sequence){
+    while (true){
+        const SharedStateBuffer* buffer = shared_buffer(shared, shared.header->current.load(memory_order_acquire));
+        sequence = buffer->sequence.load(memory_order_acquire);
+        if (sequence % 2 == 0){
+            return buffer;
+        }
+        this_thread::yield();
+    }
+}
+
+bool end_read_state(const SharedStateBuffer* buffer, uint64_t sequence){
+    atomic_thread_fence(memory_order_acquire);
+    return buffer->sequence.load(memory_order_relaxed) == sequence;
+}
+
+//Copies a consistent state, retrying while the simulator overwrites it
+TelemetrySample read_state(SharedState &shared, vector<float> &positions){
+    while (true){
+        uint64_t sequence;
+        const SharedStateBuffer* buffer = begin_read_state(shared, sequence);
+        TelemetrySample copy = {buffer->iteration, buffer->T, buffer->potential, buffer->kinetic, buffer->total, buffer->max_speed};
+        uint32_t num_masses = min(buffer->num_masses, shared.header->capacity);
+        positions.resize(3*num_masses);
+        memcpy(positions.data(), shared_positions(buffer), sizeof(float)*3*num_masses);
+        if (end_read_state(buffer, sequence)){
+            return copy;
+        }
+    }
+}
+
+//Unmaps the segment, and removes it if this process created it
+void close_shared_state(SharedState &shared){
+    if (shared.data){
+        munmap(shared.data, shared.size);
+    }
+    if (shared.owner){
+        shm_unlink(shared.name);
+    }
+    shared = SharedState();
+}
+
+//Sends what the subscriber can take without blocking, returns false once it has gone away
+bool flush_subscriber(StreamSubscriber &subscriber){
+    while (subscriber.sent < sizeof(StreamFrame)){
+        ssize_t n = send(subscriber.fd, (char*)&subscriber.pending + subscriber.sent, sizeof(StreamFrame) - subscriber.sent, MSG_NOSIGNAL); //a hang-up fails with EPIPE instead of raising SIGPIPE
+        if (n < 0){
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        subscriber.sent += n;
+    }
+    return true;
+}
+
+//Server thread: accepts subscribers and hands every frame to each of them. A subscriber still busy with an earlier
+//frame skips the new one, so a slow reader gets frames at its own rate and never holds up the others
+void serve_stream(StreamServer &server){
+    vector<pollfd> fds;
+    while (!server.closing.load(memory_order_acquire)){
+        while (true){
+            int fd = accept(server.listen_fd, nullptr, nullptr);
+            if (fd < 0){
+                break;
+            }
+            //a subscriber that would block the server thread, raise SIGPIPE or queue a backlog is turned away
+            int flags = fcntl(fd, F_GETFL);
+            bool usable = flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+            int buffer = stream_buffer_frames*sizeof(StreamFrame);
+            usable = usable && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer)) == 0;
+#ifdef SO_NOSIGPIPE
+            int on = 1;
+            usable = usable && setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on)) == 0;
+#endif
+            if (!usable){
+                close(fd);
+                continue;
+            }
+            server.subscribers.push_back({fd, StreamFrame(), sizeof(StreamFrame), 0});
+        }
+        
+        for (StreamSubscriber &subscriber : server.subscribers){
+            if (!flush_subscriber(subscriber)){
+                close(subscriber.fd);
+                subscriber.fd = -1;
+            }
+        }
+        while (StreamFrame* frame = ring_front(server.ring)){
+            for (StreamSubscriber &subscriber : server.subscribers){
+                if (subscriber.fd < 0){
+                    continue;
+                }
+                if (subscriber.sent < sizeof(StreamFrame)){
+                    subscriber.dropped++;
+                    continue;
+                }
+                subscriber.pending = *frame;
+                subscriber.sent = 0;
+                if (!flush_subscriber(subscriber)){
+                    close(subscriber.fd);
+                    subscriber.fd = -1;
+                }
+            }
+            ring_release(server.ring);
+        }
+        
+        int kept = 0;
+        for (StreamSubscriber &subscriber : server.subscribers){
+            if (subscriber.fd >= 0){
+                server.subscribers[kept++] = subscriber;
+            }
+        }
+        server.subscribers.resize(kept);
+        
+        //Sleep until a subscriber can take more, someone connects, or the next frames are due
+        fds.clear();
+        fds.push_back({server.listen_fd, POLLIN, 0});
+        for (StreamSubscriber &subscriber : server.subscribers){
+            fds.push_back({subscriber.fd, (short)(subscriber.sent < sizeof(StreamFrame) ? POLLOUT : 0), 0});
+        }
+        poll(fds.data(), fds.size(), 2);
+    }
+    for (StreamSubscriber &subscriber : server.subscribers){
+        close(subscriber.fd);
+    }
+    server.subscribers.clear();
+}
+
+//Listens on a UNIX socket at path, replacing a socket file left behind by an earlier run
+void open_stream_server(StreamServer &server, const char* path){
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)){
+        throw(ENAMETOOLONG);
+    }
+    strcpy(address.sun_path, path);
+    
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.listen_fd < 0){
+        throw(errno);
+    }
+    unlink(path);
+    int flags;
+    if (::bind(server.listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(server.listen_fd, 16) != 0
+        || (flags = fcntl(server.listen_fd, F_GETFL)) < 0 || fcntl(server.listen_fd, F_SETFL, flags | O_NONBLOCK) != 0){
+        int error = errno;
+        close(server.listen_fd);
+        server.listen_fd = -1;
+        unlink(path);
+        throw(error);
+    }
+    server.path = path;
+    server.ring.slots.assign(stream_capacity, StreamFrame());
+    server.dropped = 0;
+    server.closing = false;
+    server.worker = thread(serve_stream, ref(server));
+    writer_threads++;
+}
+
+//Called from the simulation thread, returns false if the frame was dropped because the server thread is behind
+bool push_stream_frame(StreamServer &server, StreamFrame &frame){
+    StreamFrame* slot = ring_claim(server.ring);
+    if (!slot){
+        server.dropped++;
+        return false;
+    }
+    *slot = frame;
+    ring_publish(server.ring);
+    return true;
+}
+
+void close_stream_server(StreamServer &server){
+    if (!server.worker.joinable()){
+        return;
+    }
+    server.closing.store(true, memory_order_release);
+    server.worker.join();
+    writer_threads--;
+    close(server.listen_fd);
+    unlink(server.path);
+    server.listen_fd = -1;
+}
+
+//Subscriber side: connects to a running simulator
+int connect_stream(const char* path){
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)){
+        throw(ENAMETOOLONG);
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0){
+        throw(errno);
+    }
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0){
+        int error = errno;
+        close(fd);
+        throw(error);
+    }
+    return fd;
+}
+
+//Blocks for the next frame, returns false once the simulator has closed the stream
+bool read_stream_frame(int fd, StreamFrame &frame){
+    size_t received = 0;
+    while (received < sizeof(StreamFrame)){
+        ssize_t n = recv(fd, (char*)&frame + received, sizeof(StreamFrame) - received, 0);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return false;
+        }
+        received += n;
+    }
+    return frame.size == sizeof(StreamFrame) && frame.version == stream_version;
+}
+
+void add_tetrahedron(vector<PointMass> &masses, vector<Tetrahedron> &tets, int a, int b, int c, int d){
+    Tetrahedron tet;
+    tet.m[0] = a;
+    tet.m[1] = b;
+    tet.m[2] = c;
+    tet.m[3] = d;
+    tet.body = 0; //set from the bodies once they exist
+    tet.energy = 0;
+    
+    //Rest edge matrix, columns x1-x0, x2-x0, x3-x0
+    glm::mat3 Dm;
+    for (int col=0; col<3; col++){
+        for (int n=0; n<3; n++){
+            Dm[col][n] = masses[tet.m[col+1]].position[n] - masses[a].position[n];
+        }
+    }
+    float det = glm::determinant(Dm);
+    if (det < 0){
+        //swap two corners so the tetrahedron is positively oriented
+        swap(tet.m[2], tet.m[3]);
+        swap(Dm[1], Dm[2]);
+        det = -det;
+    }
+    glm::mat3 inverse = glm::inverse(Dm);
+    for (int r=0; r<3; r++){
+        for (int col=0; col<3; col++){
+            tet.Dm_inv[3*r + col] = inverse[col][r];
+        }
+    }
+    tet.volume = det/6.0f;
+    tet.mu = tet_youngs/(2.0f*(1.0f + tet_poisson));
+    tet.lambda = tet_youngs*tet_poisson/((1.0f + tet_poisson)*(1.0f - 2.0f*tet_poisson));
+    tets.push_back(tet);
+}
+
+void add_cube_tets(vector<PointMass> &masses, vector<Tetrahedron> &tets, int corners[8], int parity){
+    //5 tetrahedra per cube: one around the central diagonal corners and four cut off the other corners.
+    //Neighbouring cubes of a lattice alternate parity so their face diagonals match
+    static const int even[5][4] = {{0, 3, 5, 6}, {1, 0, 3, 5}, {2, 0, 3, 6}, {4, 0, 5, 6}, {7, 3, 5, 6}};
+    static const int odd[5][4] = {{1, 2, 4, 7}, {0, 1, 2, 4}, {3, 1, 2, 7}, {5, 1, 4, 7}, {6, 2, 4, 7}};
+    const int (*split)[4] = parity == 0 ? even : odd;
+    for (int t=0; t<5; t++){
+        add_tetrahedron(masses, tets, corners[split[t][0]], corners[split[t][1]], corners[split[t][2]], corners[split[t][3]]);
+    }
+}
+
+void update_tet_forces(vector<PointMass> &masses, vector<Tetrahedron> &tets, vector<Body> &bodies){
+    //Matrices are stored as 9 rows of tet_batch lanes, every loop over l is the same operation on all lanes
+    float F[9][tet_batch], R[9][tet_batch], C[9][tet_batch], H[9][tet_batch];
+    
+    for (int start=0; start<tets.size(); start+=tet_batch){
+        int lanes = min(tet_batch, (int)tets.size() - start);
+        
+        //Deformation gradient F = Ds Dm^-1
+        //-------------------------------------
+        float Ds[9][tet_batch], Dm_inv[9][tet_batch];
+        for (int l=0; l<tet_batch; l++){
+            Tetrahedron &tet = tets[start + min(l, lanes-1)]; //unused lanes repeat the last tetrahedron
+            vector<float> &x0 = masses[tet.m[0]].position;
+            for (int col=0; col<3; col++){
+                vector<float> &x = masses[tet.m[col+1]].position;
+                for (int r=0; r<3; r++){
+                    Ds[3*r + col][l] = x[r] - x0[r];
+                }
+            }
+            for (int e=0; e<9; e++){
+                Dm_inv[e][l] = tet.Dm_inv[e];
+            }
+        }
+        for (int r=0; r<3; r++){
+            for (int col=0; col<3; col++){
+                for (int l=0; l<tet_batch; l++){
+                    F[3*r + col][l] = Ds[3*r][l]*Dm_inv[col][l] + Ds[3*r + 1][l]*Dm_inv[3 + col][l] + Ds[3*r + 2][l]*Dm_inv[6 + col][l];
+                }
+            }
+        }
+        //-------------------------------------
+        
+        //Rotation of the polar decomposition F = RS by the Newton iteration R = (R + R^-T)/2
+        //-------------------------------------
+        for (int e=0; e<9; e++){
+            for (int l=0; l<tet_batch; l++){
+                R[e][l] = F[e][l];
+            }
+        }
+        for (int iteration=0; iteration<polar_iterations; iteration++){
+            for (int l=0; l<tet_batch; l++){
+                //cofactor matrix, R^-T = C/det(R)
+                C[0][l] = R[4][l]*R[8][l] - R[5][l]*R[7][l];
+                C[1][l] = R[5][l]*R[6][l] - R[3][l]*R[8][l];
+                C[2][l] = R[3][l]*R[7][l] - R[4][l]*R[6][l];
+                C[3][l] = R[2][l]*R[7][l] - R[1][l]*R[8][l];
+                C[4][l] = R[0][l]*R[8][l] - R[2][l]*R[6][l];
+                C[5][l] = R[1][l]*R[6][l] - R[0][l]*R[7][l];
+                C[6][l] = R[1][l]*R[5][l] - R[2][l]*R[4][l];
+                C[7][l] = R[2][l]*R[3][l] - R[0][l]*R[5][l];
+                C[8][l] = R[0][l]*R[4][l] - R[1][l]*R[3][l];
+                float det = R[0][l]*C[0][l] + R[1][l]*C[1][l] + R[2][l]*C[2][l];
+                float half_inv_det = 0.5f/(fabs(det) > 1e-12f ? det : 1e-12f);
+                for (int e=0; e<9; e++){
+                    R[e][l] = 0.5f*R[e][l] + half_inv_det*C[e][l];
+                }
+            }
+        }
+        //-------------------------------------
+        
+        //Corotated stress P = 2 mu (F - R) + lambda tr(R^T F - I) R and nodal forces H = -V P Dm^-T
+        //-------------------------------------
+        float mu[tet_batch], lambda[tet_batch], volume[tet_batch], trace[tet_batch], P[9][tet_batch];
+        for (int l=0; l<tet_batch; l++){
+            Tetrahedron &tet = tets[start + min(l, lanes-1)];
+            mu[l] = tet.mu;
+            lambda[l] = tet.lambda;
+            volume[l] = tet.volume;
+            trace[l] = -3.0f;
+        }
+        for (int e=0; e<9; e++){
+            for (int l=0; l<tet_batch; l++){
+                trace[l] += R[e][l]*F[e][l];
+            }
+        }
+        for (int e=0; e<9; e++){
+            for (int l=0; l<tet_batch; l++){
+                P[e][l] = 2.0f*mu[l]*(F[e][l] - R[e][l]) + lambda[l]*trace[l]*R[e][l];
+            }
+        }
+        for (int r=0; r<3; r++){
+            for (int col=0; col<3; col++){
+                for (int l=0; l<tet_batch; l++){
+                    H[3*r + col][l] = -volume[l]*(P[3*r][l]*Dm_inv[3*col][l] + P[3*r + 1][l]*Dm_inv[3*col + 1][l] + P[3*r + 2][l]*Dm_inv[3*col + 2][l]);
+                }
+            }
+        }
+        //-------------------------------------
+        
+        //Scatter into the mass forces, skipping sleeping bodies
+        //-------------------------------------
+        for (int l=0; l<lanes; l++){
+            Tetrahedron &tet = tets[start + l];
+            if (bodies[tet.body].asleep){
+                continue;
+            }
+            float energy = 0;
+            for (int e=0; e<9; e++){
+                energy += mu[l]*pow(F[e][l] - R[e][l], 2);
+            }
+            tet.energy = volume[l]*(energy + 0.5f*lambda[l]*trace[l]*trace[l]);
+            
+            for (int n=0; n<3; n++){
+                float f1 = H[3*n][l];
+                float f2 = H[3*n + 1][l];
+                float f3 = H[3*n + 2][l];
+                masses[tet.m[1]].forces[n] += f1;
+                masses[tet.m[2]].forces[n] += f2;
+                masses[tet.m[3]].forces[n] += f3;
+                masses[tet.m[0]].forces[n] -= f1 + f2 + f3;
+            }
+        }
+        //-------------------------------------
     }
 }
 